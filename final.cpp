@@ -1,16 +1,116 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
 #include <string>
 #include <iomanip>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#include <ctime>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+// The coroutine front-end needs a C++20 compiler, everything else builds as before
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 using namespace std;
 
+// Files this small (counting the null terminator) live right inside their
+// directory entry instead of taking space in the data region
+const int INLINE_LIMIT = 64;
+
+// Hint the CPU to start loading memory we'll look at soon
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
+// Every number saved in an image is a fixed-width little-endian field, read
+// and written a byte at a time, so an image means the same thing whatever
+// machine, compiler or struct padding produced it
+void putLE16(char* at, unsigned int value) {
+    at[0] = (char)value;
+    at[1] = (char)(value >> 8);
+}
+
+void putLE32(char* at, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+        at[i] = (char)(value >> (8 * i));
+    }
+}
+
+void putLE64(char* at, unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        at[i] = (char)(value >> (8 * i));
+    }
+}
+
+unsigned int getLE16(const char* at) {
+    return (unsigned char)at[0] | ((unsigned int)(unsigned char)at[1] << 8);
+}
+
+unsigned int getLE32(const char* at) {
+    unsigned int value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | (unsigned char)at[i];
+    }
+    return value;
+}
+
+unsigned long long getLE64(const char* at) {
+    unsigned long long value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | (unsigned char)at[i];
+    }
+    return value;
+}
+
 // Represents a file's info in the system
 struct FileEntry {
     char fileName[100];  // name of the file
-    int startAddress;    // where the file data starts in memory
+    int startAddress;    // where the file data starts in memory (0 = stored inline, -1 = cold)
     int fileSize;        // how big the file is
+    char inlineData[INLINE_LIMIT];  // the data itself for tiny files
+    int accessCount;     // reads since creation, halved now and then so old reads fade
+    int coldOffset;      // where the compressed copy sits in the cold tier
+    int coldSize;        // compressed size in the cold tier (0 = hot)
+    unsigned int checksum;  // CRC-32 of the contents (0 = written before checksums)
+    long long expiresAt;    // unix time the file goes away by itself (0 = never)
+    unsigned int createdAt;   // unix times, 32 bits keeps the entry small
+    unsigned int modifiedAt;  // (0 = written before timestamps)
+    unsigned int accessedAt;
 
     FileEntry() {
         startAddress = 0;
@@ -19,6 +119,15 @@ struct FileEntry {
         for (int i = 0; i < 100; i++) {
             fileName[i] = '\0';
         }
+        memset(inlineData, 0, INLINE_LIMIT);
+        accessCount = 0;
+        coldOffset = 0;
+        coldSize = 0;
+        checksum = 0;
+        expiresAt = 0;
+        createdAt = 0;
+        modifiedAt = 0;
+        accessedAt = 0;
     }
 
     FileEntry(const string& name, int address, int size) {
@@ -27,282 +136,7361 @@ struct FileEntry {
 
         // Copy the name into fileName with null terminator
         int i;
-        for (i = 0; i < 99 && i < name.length(); i++) {
+        for (i = 0; i < 99 && i < (int)name.length(); i++) {
             fileName[i] = name[i];
         }
         fileName[i] = '\0';
+        memset(inlineData, 0, INLINE_LIMIT);
+        accessCount = 0;
+        coldOffset = 0;
+        coldSize = 0;
+        checksum = 0;
+        expiresAt = 0;
+        createdAt = 0;
+        modifiedAt = 0;
+        accessedAt = 0;
+    }
+
+    // The data region starts after the directory, so address 0 can't be real data
+    bool isInline() const {
+        return startAddress == 0;
+    }
+
+    // Moved out of the data region into the compressed cold tier
+    bool isCold() const {
+        return coldSize > 0;
+    }
+
+    bool isExpired(long long now) const {
+        return expiresAt != 0 && expiresAt <= now;
     }
 };
 
-// The main file system handler
-class FileSystem {
-private:
-    static const int TOTAL_SIZE = 10 * 1024 * 1024;  // 10MB total space
-    static const int DIR_SIZE = 1 * 1024 * 1024;     // 1MB just for directory stuff
-    static const int DATA_SIZE = 9 * 1024 * 1024;    // 9MB for actual file content
-    static const int MAX_FILES = 100;                // Max number of files allowed
+// One file's data as returned by a batch read
+struct FileContents {
+    bool found;
+    string data;
+};
 
-    char* storage;                   // Full storage buffer
-    string diskFileName;            // Filename used to store our "virtual disk"
-    FileEntry directory[MAX_FILES]; // List of file entries
-    int fileCount;                  // How many files we have
-    int nextFreeAddress;            // Where to put the next file's data
+// A file on its way to or from an archive: contents plus what it knows about itself
+struct ArchivedFile {
+    string name;
+    string data;
+    long long expiresAt;        // 0 = never
+    unsigned int createdAt;
+    unsigned int modifiedAt;
+    map<string, string> attributes;
+
+    ArchivedFile() {
+        expiresAt = 0;
+        createdAt = 0;
+        modifiedAt = 0;
+    }
+};
+
+// A tenant's share of a volume. The namespace is the part of a file name
+// before the first '/', files without one are in the "" namespace.
+struct NamespaceUsage {
+    string name;
+    int files;
+    long long bytes;
+    int maxFiles;           // 0 = no limit
+    long long maxBytes;     // 0 = no limit
+
+    NamespaceUsage() {
+        files = 0;
+        bytes = 0;
+        maxFiles = 0;
+        maxBytes = 0;
+    }
+};
+
+// What a scrub found. Problems are "<file name>: <what's wrong>".
+struct ScrubReport {
+    int filesChecked;
+    int filesUnverified;     // no checksum, written before checksums existed
+    long long bytesChecked;
+    vector<string> problems;
+
+    ScrubReport() {
+        filesChecked = 0;
+        filesUnverified = 0;
+        bytesChecked = 0;
+    }
 
+    void add(const ScrubReport& other) {
+        filesChecked += other.filesChecked;
+        filesUnverified += other.filesUnverified;
+        bytesChecked += other.bytesChecked;
+        problems.insert(problems.end(), other.problems.begin(), other.problems.end());
+    }
+};
+
+// How the block cache picks what to throw out when it's full
+enum CachePolicy {
+    POLICY_LRU,  // plain least-recently-used
+    POLICY_2Q    // new blocks wait in a small FIFO and only become "hot" when reused
+};
+
+// Counters kept by the block cache
+struct CacheStats {
+    long long hits;        // block was already cached
+    long long misses;      // block had to be read from disk
+    long long evictions;   // blocks thrown out to make room
+    long long ghostHits;   // misses on blocks we evicted from the FIFO not long ago
+    long long promotions;  // blocks that made it into the hot queue
+
+    CacheStats() {
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+        ghostHits = 0;
+        promotions = 0;
+    }
+
+    double hitRate() const {
+        long long total = hits + misses;
+        return total == 0 ? 0.0 : (double)hits / total;
+    }
+};
+
+// Fixed-size block cache that sits in front of the disk image.
+// With POLICY_2Q a block read once (like during a big sweep over every file)
+// only ever lives in the small FIFO, so it can't push the hot working set out.
+class BlockCache {
 public:
-    FileSystem(const string& filename) {
-        diskFileName = filename;
-        fileCount = 0;
+    static const int BLOCK_SIZE = 4096;
 
-        storage = new char[TOTAL_SIZE];
+    BlockCache(int capacityBlocks, CachePolicy cachePolicy) {
+        capacity = capacityBlocks < 1 ? 1 : capacityBlocks;
+        policy = cachePolicy;
 
-        // Wipe storage clean
-        for (int i = 0; i < TOTAL_SIZE; i++) {
-            storage[i] = 0;
+        // 2Q tuning from the paper: FIFO gets a quarter, ghosts remember half
+        fifoLimit = capacity / 4 < 1 ? 1 : capacity / 4;
+        ghostLimit = capacity / 2 < 1 ? 1 : capacity / 2;
+
+        memory.resize((size_t)capacity * BLOCK_SIZE);
+        for (int i = capacity - 1; i >= 0; i--) {
+            freeSlots.push_back(i);
         }
+    }
 
-        // Data starts after directory section
-        nextFreeAddress = DIR_SIZE;
+    // Find a cached block. Returns nullptr (and counts a miss) if it isn't here.
+    char* lookup(int blockNo) {
+        unordered_map<int, Slot>::iterator it = slots.find(blockNo);
+        if (it == slots.end()) {
+            stats.misses++;
+            if (ghosts.count(blockNo) > 0) {
+                stats.ghostHits++;
+            }
+            return nullptr;
+        }
 
-        // Try loading old data if it exists
-        loadFromDisk();
+        stats.hits++;
+        Slot& slot = it->second;
+        // Blocks in the FIFO stay put on a hit, that's what makes 2Q scan resistant
+        if (slot.hot) {
+            hotQueue.splice(hotQueue.begin(), hotQueue, slot.position);
+        }
+        return blockData(slot.index);
     }
 
-    ~FileSystem() {
-        saveToDisk();
-        delete[] storage;
+    // Look at a cached block without touching the counters or the queues
+    char* peek(int blockNo) {
+        unordered_map<int, Slot>::iterator it = slots.find(blockNo);
+        if (it == slots.end()) {
+            return nullptr;
+        }
+        return blockData(it->second.index);
     }
 
-    // Make a new file with some data
-    void createNewFile(const string& filename, const string& data) {
-        if (findFile(filename) != nullptr) {
-            cout << "\n!!! ERROR: File '" << filename << "' already exists !!! \n";
-            return;
+    // Make room for a block after a miss. The caller fills the returned buffer.
+    char* insert(int blockNo) {
+        if (slots.count(blockNo) > 0) {
+            return peek(blockNo);
         }
 
-        if (fileCount >= MAX_FILES) {
-            cout << "\n*** SYSTEM LIMIT REACHED: Cannot store more than " << MAX_FILES << " files! ***\n";
-            return;
+        if (freeSlots.empty()) {
+            evictOne();
         }
 
-        int dataSize = data.length() + 1; // Include null terminator
-        if (nextFreeAddress + dataSize > TOTAL_SIZE) {
-            cout << "\n!!! WARNING: STORAGE FULL !!! Not enough room for this file!\n";
-            return;
-        }
+        Slot slot;
+        slot.index = freeSlots.back();
+        freeSlots.pop_back();
 
-        // Copy data into storage
-        for (int i = 0; i < data.length(); i++) {
-            storage[nextFreeAddress + i] = data[i];
+        // LRU puts everything straight into the hot queue. 2Q only does that for
+        // blocks that were seen recently enough to still be in the ghost list.
+        unordered_map<int, list<int>::iterator>::iterator ghost = ghosts.find(blockNo);
+        if (policy == POLICY_LRU || ghost != ghosts.end()) {
+            if (ghost != ghosts.end()) {
+                ghostQueue.erase(ghost->second);
+                ghosts.erase(ghost);
+                stats.promotions++;
+            }
+            slot.hot = true;
+            hotQueue.push_front(blockNo);
+            slot.position = hotQueue.begin();
+        }
+        else {
+            slot.hot = false;
+            fifoQueue.push_front(blockNo);
+            slot.position = fifoQueue.begin();
         }
-        storage[nextFreeAddress + data.length()] = '\0';
 
-        // Add to directory
-        FileEntry newFile(filename, nextFreeAddress, dataSize);
-        directory[fileCount++] = newFile;
+        slots[blockNo] = slot;
+        return blockData(slot.index);
+    }
 
-        nextFreeAddress += dataSize;
+    int size() const {
+        return (int)slots.size();
+    }
 
-        cout << "\n>>> SUCCESS: File '" << filename << "' created successfully! <<<\n";
+    int getCapacity() const {
+        return capacity;
+    }
 
-        saveToDisk();
+    CachePolicy getPolicy() const {
+        return policy;
     }
 
-    // Show all saved files
-    void listFiles() {
-        cout << "\n=== FILES IN THE SYSTEM ===\n";
-        cout << "===================================\n";
+    // Most blocks that can be loaded ahead of use and still all be there
+    // when they're read. Under 2Q new blocks land in the FIFO, which gets
+    // trimmed to fifoLimit as soon as anything is hot.
+    int prefetchLimit() const {
+        return policy == POLICY_2Q ? fifoLimit : capacity / 2;
+    }
 
-        if (fileCount == 0) {
-            cout << "** No files found. Storage is empty! **\n";
-            return;
-        }
+    const CacheStats& getStats() const {
+        return stats;
+    }
 
-        cout << left << setw(4) << "#" << setw(40) << "FILENAME" << "SIZE\n";
-        cout << "-----------------------------------\n";
+    void resetStats() {
+        stats = CacheStats();
+    }
 
-        for (int i = 0; i < fileCount; i++) {
-            cout << left << setw(4) << (i + 1) << setw(40) << directory[i].fileName
-                << directory[i].fileSize << " bytes\n";
+private:
+    struct Slot {
+        int index;                      // which buffer in memory holds the block
+        bool hot;                       // in hotQueue (true) or fifoQueue (false)
+        list<int>::iterator position;   // where it sits in that queue
+    };
+
+    int capacity;
+    CachePolicy policy;
+    int fifoLimit;
+    int ghostLimit;
+
+    vector<char> memory;                // capacity * BLOCK_SIZE bytes of cached data
+    vector<int> freeSlots;              // unused buffers
+    unordered_map<int, Slot> slots;     // block number -> cached buffer
+
+    list<int> fifoQueue;                // 2Q "A1in": blocks seen once, oldest at the back
+    list<int> hotQueue;                 // LRU list of hot blocks, coldest at the back
+    list<int> ghostQueue;               // 2Q "A1out": recently evicted block numbers only
+    unordered_map<int, list<int>::iterator> ghosts;
+
+    CacheStats stats;
+
+    char* blockData(int index) {
+        return &memory[(size_t)index * BLOCK_SIZE];
+    }
+
+    void evictOne() {
+        int victim;
+        bool fromFifo = !fifoQueue.empty() && ((int)fifoQueue.size() > fifoLimit || hotQueue.empty());
+
+        if (fromFifo) {
+            victim = fifoQueue.back();
+            fifoQueue.pop_back();
+
+            // Remember it for a while so a second touch promotes it
+            ghostQueue.push_front(victim);
+            ghosts[victim] = ghostQueue.begin();
+            if ((int)ghostQueue.size() > ghostLimit) {
+                ghosts.erase(ghostQueue.back());
+                ghostQueue.pop_back();
+            }
         }
-        cout << "===================================\n";
-        cout << "Total files: " << fileCount << "/" << MAX_FILES << "\n";
+        else {
+            victim = hotQueue.back();
+            hotQueue.pop_back();
+        }
+
+        freeSlots.push_back(slots[victim].index);
+        slots.erase(victim);
+        stats.evictions++;
     }
+};
 
-    // View what's inside a file
-    void viewFile(const string& filename) {
-        FileEntry* file = findFile(filename);
-        if (file == nullptr) {
-            cout << "\n!!! ERROR: File '" << filename << "' not found! !!!\n";
-            return;
+// Positioned reads/writes on the image file without dragging the whole thing
+// into memory. Uses pread/pwrite on POSIX so we can also hint the kernel.
+class DiskFile {
+public:
+    DiskFile() {
+        fd = -1;
+        created = false;
+    }
+
+    ~DiskFile() {
+        close();
+    }
+
+    // Open the image, making a blank one of the given size if it isn't there
+    bool open(const string& path, long long size) {
+        close();
+        created = false;
+#ifdef _WIN32
+        stream.open(path.c_str(), ios::in | ios::out | ios::binary);
+        if (!stream) {
+            ofstream create(path.c_str(), ios::binary);
+            if (!create) {
+                return false;
+            }
+            create.seekp(size - 1);
+            create.put('\0');
+            create.close();
+            created = true;
+
+            stream.clear();
+            stream.open(path.c_str(), ios::in | ios::out | ios::binary);
+        }
+        fd = stream ? 0 : -1;
+#else
+        fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0 && errno == ENOENT) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            created = fd >= 0;
+        }
+        if (fd >= 0 && created && ftruncate(fd, size) != 0) {
+            close();
         }
+#endif
+        return fd >= 0;
+    }
 
-        cout << "\n=== CONTENTS OF '" << filename << "' ===\n";
-        cout << "===================================\n";
-        for (int i = 0; i < file->fileSize - 1; i++) {
-            cout << storage[file->startAddress + i];
+    // Open an existing image for reading only, never creating or changing it
+    bool openReadOnly(const string& path) {
+        close();
+        created = false;
+#ifdef _WIN32
+        stream.open(path.c_str(), ios::in | ios::binary);
+        fd = stream ? 0 : -1;
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+#endif
+        return fd >= 0;
+    }
+
+    // Bytes in the file right now, -1 if that can't be found out
+    long long size() {
+#ifdef _WIN32
+        stream.seekg(0, ios::end);
+        long long end = (long long)stream.tellg();
+        stream.clear();
+        return end;
+#else
+        struct stat info;
+        return fstat(fd, &info) == 0 ? (long long)info.st_size : -1;
+#endif
+    }
+
+    // Map the first 'length' bytes as a private read-only view (the page cache
+    // does the reading, on demand). nullptr where mmap isn't available.
+    char* mapReadOnly(long long length) {
+#ifdef _WIN32
+        (void)length;
+        return nullptr;
+#else
+        void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        return mapping == MAP_FAILED ? nullptr : (char*)mapping;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (stream.is_open()) {
+            stream.close();
         }
-        cout << "\n===================================\n";
+#else
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+        fd = -1;
     }
 
-    // Delete a file from the system
-    void deleteFile(const string& filename) {
-        int fileIndex = -1;
-        for (int i = 0; i < fileCount; i++) {
-            if (strcmp(directory[i].fileName, filename.c_str()) == 0) {
-                fileIndex = i;
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // True if open() had to make a new image
+    bool wasCreated() const {
+        return created;
+    }
+
+    // Read bytes at an offset. Anything past the end of the file reads as zeros.
+    bool readAt(long long offset, char* out, int length) {
+        int done = 0;
+#ifdef _WIN32
+        stream.seekg(offset);
+        stream.read(out, length);
+        done = (int)stream.gcount();
+        stream.clear();
+#else
+        while (done < length) {
+            ssize_t n = pread(fd, out + done, length - done, offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
                 break;
             }
+            done += (int)n;
         }
+#endif
+        memset(out + done, 0, length - done);
+        return true;
+    }
 
-        if (fileIndex == -1) {
-            cout << "\n!!! ERROR: File '" << filename << "' not found! !!!\n";
-            return;
+    bool writeAt(long long offset, const char* data, int length) {
+#ifdef _WIN32
+        stream.seekp(offset);
+        stream.write(data, length);
+        stream.flush();
+        return (bool)stream;
+#else
+        int done = 0;
+        while (done < length) {
+            ssize_t n = pwrite(fd, data + done, length - done, offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            done += (int)n;
         }
+        return true;
+#endif
+    }
 
-        // Just remove from directory, don't reclaim data space
-        for (int i = fileIndex; i < fileCount - 1; i++) {
-            directory[i] = directory[i + 1];
+    // Advisory fcntl lock on a byte range, waits until it's granted. The lock
+    // belongs to the process and goes away if ANY descriptor it has on this
+    // file is closed, so don't open the image anywhere else while holding it.
+    bool lock(long long offset, long long length, bool exclusive) {
+#ifdef _WIN32
+        (void)offset;
+        (void)length;
+        (void)exclusive;
+        return false;
+#else
+        struct flock request;
+        memset(&request, 0, sizeof(request));
+        request.l_type = exclusive ? F_WRLCK : F_RDLCK;
+        request.l_whence = SEEK_SET;
+        request.l_start = offset;
+        request.l_len = length;
+        while (fcntl(fd, F_SETLKW, &request) != 0) {
+            if (errno != EINTR) {
+                return false;
+            }
         }
-        fileCount--;
+        return true;
+#endif
+    }
 
-        cout << "\n>>> File '" << filename << "' has been DELETED! <<<\n";
-        saveToDisk();
-    }
-
-    // Main menu loop
-    void runFileSystem() {
-        int choice;
-        bool running = true;
-
-        while (running) {
-            cout << "\n+===================================+\n";
-            cout << "|   SUPER FILE STORAGE SYSTEM 3000   |\n";
-            cout << "+===================================+\n";
-            cout << "+-----------------------------------+\n";
-            cout << "| 1. Create a new file              |\n";
-            cout << "| 2. List files                     |\n";
-            cout << "| 3. View file contents             |\n";
-            cout << "| 4. Delete file                    |\n";
-            cout << "| 5. Exit                           |\n";
-            cout << "+-----------------------------------+\n";
-            cout << "Enter your choice: ";
-
-            cin >> choice;
-
-            if (cin.fail()) {
-                cin.clear();
-                char c;
-                while ((c = cin.get()) != '\n' && c != EOF) {}
-                cout << "\n!!! CONFUSED !!! That's not a number I recognize! Try again.\n";
-                continue;
-            }
+    void unlock(long long offset, long long length) {
+#ifndef _WIN32
+        struct flock request;
+        memset(&request, 0, sizeof(request));
+        request.l_type = F_UNLCK;
+        request.l_whence = SEEK_SET;
+        request.l_start = offset;
+        request.l_len = length;
+        fcntl(fd, F_SETLK, &request);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
 
-            char c;
-            while ((c = cin.get()) != '\n' && c != EOF) {}
+    // Tell the kernel we're about to read this range so it can start fetching now
+    void willNeed(long long offset, long long length) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
 
-            string filename, data, line;
+private:
+    int fd;          // POSIX descriptor (on Windows just 0 = open, -1 = closed)
+    bool created;
+#ifdef _WIN32
+    fstream stream;
+#endif
+};
 
-            switch (choice) {
-            case 1:
-                cout << ">> Enter filename: ";
-                getline(cin, filename);
+// Spreads the data region over several backing files (ideally on different
+// disks) in fixed size units, round robin. A big transfer gets split into one
+// piece list per file and each file's share runs on its own thread.
+class StripeSet {
+public:
+    static const int MAX_STRIPES = 8;
+    static const int MAX_PATH_LENGTH = 256;
+    static const int RECORD_MAGIC = 0x31525453;       // "STR1"
+    static const int RECORD_SIZE = 12 + MAX_STRIPES * MAX_PATH_LENGTH;
+    static const int DEFAULT_UNIT = 64 * 1024;
+    static const int PARALLEL_MIN = 64 * 1024;        // smaller transfers aren't worth a thread
 
-                cout << ">> Enter file content (type '###END###' to finish):\n";
-                data = "";
-                while (getline(cin, line)) {
-                    if (line == "###END###") break;
-                    data += line + "\n";
-                }
+    StripeSet() {
+        unitSize = 0;
+        parallelTransfers = 0;
+    }
 
-                createNewFile(filename, data);
-                break;
+    ~StripeSet() {
+        close();
+    }
 
-            case 2:
-                listFiles();
-                system("pause");
-                break;
+    // Open (or create) every stripe file, big enough for its share of regionSize.
+    // Read-only, every stripe has to be there already at full size.
+    bool open(const vector<string>& stripePaths, int unit, long long regionSize, bool readOnly = false) {
+        close();
+        long long units = (regionSize + unit - 1) / unit;
+        long long fileSize = (units + stripePaths.size() - 1) / stripePaths.size() * unit;
 
-            case 3:
-                listFiles();
-                cout << ">> Enter filename to view: ";
-                getline(cin, filename);
-                viewFile(filename);
-                system("pause");
-                break;
+        for (int i = 0; i < (int)stripePaths.size(); i++) {
+            DiskFile* file = new DiskFile();
+            files.push_back(file);
+            bool opened = readOnly ? file->openReadOnly(stripePaths[i]) && file->size() >= fileSize
+                                   : file->open(stripePaths[i], fileSize);
+            if (!opened) {
+                close();
+                return false;
+            }
+        }
+        paths = stripePaths;
+        unitSize = unit;
+        return true;
+    }
 
-            case 4:
-                listFiles();
-                cout << ">> Enter filename to delete: ";
-                getline(cin, filename);
-                deleteFile(filename);
-                break;
+    void close() {
+        for (int i = 0; i < (int)files.size(); i++) {
+            delete files[i];
+        }
+        files.clear();
+        paths.clear();
+        unitSize = 0;
+    }
 
-            case 5:
-                cout << "\n*** Thanks for using the SUPER FILE STORAGE SYSTEM 3000! Goodbye! ***\n";
-                running = false;
-                break;
+    bool isOpen() const {
+        return !files.empty();
+    }
+
+    int count() const {
+        return files.size();
+    }
+
+    int getUnitSize() const {
+        return unitSize;
+    }
 
-            default:
-                cout << "\n!!! INVALID CHOICE !!! Please select from the menu options (1-5)\n";
+    long long getParallelTransfers() const {
+        return parallelTransfers;
+    }
+
+    // Offsets are relative to the start of the striped region
+    bool readAt(long long offset, char* out, int length) {
+        return transfer(offset, out, length, false);
+    }
+
+    bool writeAt(long long offset, const char* data, int length) {
+        return transfer(offset, (char*)data, length, true);
+    }
+
+    void willNeed(long long offset, long long length) {
+        vector<vector<Piece> > perFile;
+        split(offset, length, perFile);
+        for (int i = 0; i < (int)perFile.size(); i++) {
+            for (int j = 0; j < (int)perFile[i].size(); j++) {
+                files[i]->willNeed(perFile[i][j].fileOffset, perFile[i][j].length);
             }
         }
     }
 
+    // The layout lives in the image's directory so reopening finds the same files
+    void saveRecord(char* area) const {
+        memset(area, 0, RECORD_SIZE);
+        if (!isOpen()) {
+            return;
+        }
+        putLE32(area, RECORD_MAGIC);
+        putLE32(area + 4, count());
+        putLE32(area + 8, unitSize);
+        for (int i = 0; i < count(); i++) {
+            strncpy(area + 12 + i * MAX_PATH_LENGTH, paths[i].c_str(), MAX_PATH_LENGTH - 1);
+        }
+    }
+
+    // Returns false if the image isn't striped
+    static bool loadRecord(const char* area, vector<string>& stripePaths, int& unit) {
+        int stripeCount = (int)getLE32(area + 4);
+        unit = (int)getLE32(area + 8);
+        if ((int)getLE32(area) != RECORD_MAGIC || stripeCount <= 0 || stripeCount > MAX_STRIPES || unit <= 0) {
+            return false;
+        }
+
+        stripePaths.clear();
+        for (int i = 0; i < stripeCount; i++) {
+            const char* path = area + 12 + i * MAX_PATH_LENGTH;
+            stripePaths.push_back(string(path, strnlen(path, MAX_PATH_LENGTH)));
+        }
+        return true;
+    }
+
 private:
-    // Helper to find file by name
-    FileEntry* findFile(const string& filename) {
-        for (int i = 0; i < fileCount; i++) {
-            if (strcmp(directory[i].fileName, filename.c_str()) == 0) {
-                return &directory[i];
+    // One contiguous run inside a single stripe file
+    struct Piece {
+        long long fileOffset;
+        int bufferOffset;
+        int length;
+    };
+
+    vector<DiskFile*> files;
+    vector<string> paths;
+    int unitSize;
+    atomic<long long> parallelTransfers;    // transfers that fanned out to more than one file (scrub workers count too)
+
+    // Cut [offset, offset + length) into per-file runs, one per stripe unit
+    // (a unit only continues the previous run when the stripe count is 1)
+    void split(long long offset, long long length, vector<vector<Piece> >& perFile) const {
+        perFile.assign(files.size(), vector<Piece>());
+        long long done = 0;
+        while (done < length) {
+            long long position = offset + done;
+            long long unit = position / unitSize;
+            int within = (int)(position % unitSize);
+            int chunk = (int)min((long long)(unitSize - within), length - done);
+            int fileNo = (int)(unit % files.size());
+            long long fileOffset = (unit / files.size()) * unitSize + within;
+
+            vector<Piece>& pieces = perFile[fileNo];
+            if (!pieces.empty() && pieces.back().fileOffset + pieces.back().length == fileOffset
+                && pieces.back().bufferOffset + pieces.back().length == done) {
+                pieces.back().length += chunk;
             }
+            else {
+                Piece piece;
+                piece.fileOffset = fileOffset;
+                piece.bufferOffset = (int)done;
+                piece.length = chunk;
+                pieces.push_back(piece);
+            }
+            done += chunk;
         }
-        return nullptr;
     }
 
-    // Load data from the disk file
-    void loadFromDisk() {
-        ifstream file(diskFileName.c_str(), ios::binary);
-        if (!file) {
-            cout << "*** No previous data found. Starting fresh! ***\n";
-            return;
+    static void transferPieces(DiskFile* file, const vector<Piece>& pieces, char* buffer, bool writing, char* ok) {
+        *ok = 1;
+        for (int i = 0; i < (int)pieces.size(); i++) {
+            char* at = buffer + pieces[i].bufferOffset;
+            bool done = writing ? file->writeAt(pieces[i].fileOffset, at, pieces[i].length)
+                                : file->readAt(pieces[i].fileOffset, at, pieces[i].length);
+            if (!done) {
+                *ok = 0;
+            }
         }
+    }
 
-        file.read(storage, TOTAL_SIZE);
+    bool transfer(long long offset, char* buffer, int length, bool writing) {
+        vector<vector<Piece> > perFile;
+        split(offset, length, perFile);
+        vector<char> ok(files.size(), 1);
 
-        fileCount = *((int*)storage);
-        nextFreeAddress = *((int*)(storage + 4));
+        int busyFiles = 0;
+        for (int i = 0; i < (int)files.size(); i++) {
+            if (!perFile[i].empty()) {
+                busyFiles++;
+            }
+        }
 
-        for (int i = 0; i < fileCount; i++) {
-            FileEntry* entry = (FileEntry*)(storage + 8 + i * sizeof(FileEntry));
-            directory[i] = *entry;
+        // Small transfers (or ones that stay in one file) just run here
+        vector<thread> workers;
+        for (int i = 0; i < (int)files.size(); i++) {
+            if (perFile[i].empty()) {
+                continue;
+            }
+            if (busyFiles > 1 && length >= PARALLEL_MIN) {
+                workers.push_back(thread(transferPieces, files[i], cref(perFile[i]), buffer, writing, &ok[i]));
+            }
+            else {
+                transferPieces(files[i], perFile[i], buffer, writing, &ok[i]);
+            }
+        }
+        if (!workers.empty()) {
+            parallelTransfers++;
+        }
+        for (int i = 0; i < (int)workers.size(); i++) {
+            workers[i].join();
         }
 
-        cout << ">>> Loaded file system with " << fileCount << " files successfully! <<<\n";
+        for (int i = 0; i < (int)ok.size(); i++) {
+            if (!ok[i]) {
+                return false;
+            }
+        }
+        return true;
     }
+};
 
-    // Save everything to the disk file
-    void saveToDisk() {
-        *((int*)storage) = fileCount;
-        *((int*)(storage + 4)) = nextFreeAddress;
+// Tiny LZ77 used by the cold tier. The output is a list of tokens: a byte
+// below 0x80 means that many + 1 literal bytes follow, anything else copies
+// (byte & 0x7F) + 4 bytes from a distance given in the next two bytes.
+static void lzLiterals(const char* in, int length, string& out) {
+    while (length > 0) {
+        int run = min(length, 128);
+        out += (char)(run - 1);
+        out.append(in, run);
+        in += run;
+        length -= run;
+    }
+}
 
-        for (int i = 0; i < fileCount; i++) {
-            FileEntry* entry = (FileEntry*)(storage + 8 + i * sizeof(FileEntry));
-            *entry = directory[i];
+void lzCompress(const char* in, int length, string& out) {
+    static const int HASH_BITS = 12;
+    static const int MAX_MATCH = 0x7F + 4;
+    vector<int> recent(1 << HASH_BITS, -1);   // last position each 4 byte prefix was seen
+
+    out.clear();
+    int literalStart = 0;
+    int pos = 0;
+    while (pos + 4 <= length) {
+        unsigned int word;
+        memcpy(&word, in + pos, 4);
+        unsigned int hash = (word * 2654435761u) >> (32 - HASH_BITS);
+        int candidate = recent[hash];
+        recent[hash] = pos;
+
+        if (candidate < 0 || pos - candidate > 0xFFFF || memcmp(in + candidate, in + pos, 4) != 0) {
+            pos++;
+            continue;
         }
 
-        ofstream file(diskFileName.c_str(), ios::binary);
-        if (!file) {
-            cerr << "\n!!! CRITICAL ERROR !!! Couldn't save to " << diskFileName << "!\n";
-            return;
+        int matchLength = 4;
+        while (pos + matchLength < length && matchLength < MAX_MATCH && in[candidate + matchLength] == in[pos + matchLength]) {
+            matchLength++;
         }
 
-        file.write(storage, TOTAL_SIZE);
-        file.close();
+        lzLiterals(in + literalStart, pos - literalStart, out);
+        int distance = pos - candidate;
+        out += (char)(0x80 | (matchLength - 4));
+        out += (char)(distance & 0xFF);
+        out += (char)(distance >> 8);
+        pos += matchLength;
+        literalStart = pos;
     }
-};
+    lzLiterals(in + literalStart, length - literalStart, out);
+}
 
-int main() {
-    FileSystem fs("simpledisk.bin");
-    fs.runFileSystem();
-    return 0;
+// Returns false if the input is damaged or doesn't fill exactly outLength bytes
+bool lzDecompress(const char* in, int inLength, char* out, int outLength) {
+    int inPos = 0;
+    int outPos = 0;
+    while (inPos < inLength) {
+        unsigned char token = (unsigned char)in[inPos++];
+        if (token < 0x80) {
+            int run = token + 1;
+            if (inPos + run > inLength || outPos + run > outLength) {
+                return false;
+            }
+            memcpy(out + outPos, in + inPos, run);
+            inPos += run;
+            outPos += run;
+            continue;
+        }
+
+        if (inPos + 2 > inLength) {
+            return false;
+        }
+        int matchLength = (token & 0x7F) + 4;
+        int distance = (unsigned char)in[inPos] | ((unsigned char)in[inPos + 1] << 8);
+        inPos += 2;
+        if (distance == 0 || distance > outPos || outPos + matchLength > outLength) {
+            return false;
+        }
+        // Byte by byte on purpose, a match may overlap what it's producing
+        for (int i = 0; i < matchLength; i++) {
+            out[outPos + i] = out[outPos - distance + i];
+        }
+        outPos += matchLength;
+    }
+    return outPos == outLength;
+}
+
+// CRC-32 (the zip/ethernet one), table driven
+static vector<unsigned int> makeCrcTable() {
+    vector<unsigned int> table(256);
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int value = i;
+        for (int bit = 0; bit < 8; bit++) {
+            value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+        }
+        table[i] = value;
+    }
+    return table;
+}
+
+unsigned int crc32(const char* data, int length, unsigned int crc = 0) {
+    static const vector<unsigned int> table = makeCrcTable();
+    crc = ~crc;
+    for (int i = 0; i < length; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// File checksums keep 0 for "none recorded"
+unsigned int checksumOf(const char* data, int length) {
+    unsigned int sum = crc32(data, length);
+    return sum == 0 ? 1 : sum;
+}
+
+// Compressed home for files nobody has read in a while, kept in one file next
+// to the image. Space is handed out first-fit like the data region's extents,
+// and the free list is rebuilt from the directory on load so it's never saved.
+class ColdTier {
+public:
+    ColdTier() {
+        end = 0;
+        readOnly = false;
+    }
+
+    // A read-only tier only opens a file that's already there and big enough
+    void setPath(const string& filePath, bool readOnlyFile) {
+        path = filePath;
+        readOnly = readOnlyFile;
+    }
+
+    // Store a file, returns its offset (and how much space it took) or -1
+    int put(const char* data, int length, int& storedSize) {
+        if (!ensureOpen()) {
+            return -1;
+        }
+
+        // First byte says how the rest is stored, raw wins if compression doesn't help
+        string packed;
+        lzCompress(data, length, packed);
+        string blob(1, (char)STORED_LZ);
+        if ((int)packed.size() >= length) {
+            blob[0] = (char)STORED_RAW;
+            blob.append(data, length);
+        }
+        else {
+            blob += packed;
+        }
+
+        int offset = allocate((int)blob.size());
+        if (!file.writeAt(offset, blob.data(), (int)blob.size())) {
+            release(offset, (int)blob.size());
+            return -1;
+        }
+        storedSize = (int)blob.size();
+        return offset;
+    }
+
+    bool get(int offset, int storedSize, char* out, int length) {
+        if (!ensureOpen()) {
+            return false;
+        }
+
+        vector<char> blob(storedSize);
+        if (!file.readAt(offset, blob.data(), storedSize)) {
+            return false;
+        }
+        if (blob[0] == STORED_RAW) {
+            if (storedSize - 1 != length) {
+                return false;
+            }
+            memcpy(out, blob.data() + 1, length);
+            return true;
+        }
+        return lzDecompress(blob.data() + 1, storedSize - 1, out, length);
+    }
+
+    void release(int offset, int size) {
+        map<int, int>::iterator next = holes.lower_bound(offset);
+        if (next != holes.end() && offset + size == next->first) {
+            size += next->second;
+            holes.erase(next);
+        }
+        map<int, int>::iterator prev = holes.lower_bound(offset);
+        if (prev != holes.begin()) {
+            --prev;
+            if (prev->first + prev->second == offset) {
+                offset = prev->first;
+                size += prev->second;
+                holes.erase(prev);
+            }
+        }
+
+        // A hole at the very end just pulls the end back
+        if (offset + size == end) {
+            end = offset;
+        }
+        else {
+            holes[offset] = size;
+        }
+    }
+
+    // Work out the holes from where the cold files sit
+    void rebuild(vector<pair<int, int> > extents) {
+        sort(extents.begin(), extents.end());
+        holes.clear();
+        end = 0;
+        for (int i = 0; i < (int)extents.size(); i++) {
+            if (extents[i].first > end) {
+                holes[end] = extents[i].first - end;
+            }
+            end = max(end, extents[i].first + extents[i].second);
+        }
+    }
+
+    int getEnd() const {
+        return end;
+    }
+
+    // get() opens the file on first use, call this first to share it between threads
+    bool open() {
+        return ensureOpen();
+    }
+
+private:
+    static const char STORED_RAW = 0;
+    static const char STORED_LZ = 1;
+
+    string path;
+    DiskFile file;
+    map<int, int> holes;    // free offset -> size
+    int end;                // nothing at or past here is in use
+    bool readOnly;
+
+    // Only make the file once something actually goes cold
+    bool ensureOpen() {
+        if (file.isOpen()) {
+            return true;
+        }
+        if (readOnly) {
+            if (!file.openReadOnly(path) || file.size() < end) {
+                file.close();
+                cerr << "\n!!! CRITICAL ERROR !!! The cold tier " << path << " is missing or too short!\n";
+                return false;
+            }
+            return true;
+        }
+        if (!file.open(path, BlockCache::BLOCK_SIZE)) {
+            cerr << "\n!!! CRITICAL ERROR !!! Couldn't open the cold tier " << path << "!\n";
+            return false;
+        }
+        return true;
+    }
+
+    int allocate(int size) {
+        for (map<int, int>::iterator it = holes.begin(); it != holes.end(); ++it) {
+            if (it->second >= size) {
+                int offset = it->first;
+                int remaining = it->second - size;
+                holes.erase(it);
+                if (remaining > 0) {
+                    holes[offset + size] = remaining;
+                }
+                return offset;
+            }
+        }
+        int offset = end;
+        end += size;
+        return offset;
+    }
+};
+
+// Sequential-read detection counters
+struct ReadAheadStats {
+    long long sequentialReads;  // ranged reads that continued where the last one stopped
+    long long randomReads;      // ranged reads that jumped somewhere else
+    long long prefetchCalls;    // times we pulled a window in ahead of the reader
+    long long prefetchedBlocks; // blocks brought into the cache by read-ahead
+
+    ReadAheadStats() {
+        sequentialReads = 0;
+        randomReads = 0;
+        prefetchCalls = 0;
+        prefetchedBlocks = 0;
+    }
+};
+
+// The numbers behind "Show statistics", for tools that parse them
+struct VolumeMetrics {
+    int files;
+    int capacity;
+    long long dataUsed;         // high water mark of the data region
+    long long dataSize;
+    long long freeBytes;
+    long long largestFree;
+    int inlineFiles;
+    int coldFiles;
+    long long coldBytes;        // file bytes in the cold tier
+    long long coldStored;       // what they take there compressed
+    long long demotions;
+    long long promotions;
+    int unsavedReads;
+    long long generation;
+    bool cached;                // false = whole image in memory, the cache numbers are 0
+    int cacheBlocks;
+    int cacheCapacity;
+    CacheStats cache;
+    ReadAheadStats readAhead;
+
+    VolumeMetrics() {
+        files = 0;
+        capacity = 0;
+        dataUsed = 0;
+        dataSize = 0;
+        freeBytes = 0;
+        largestFree = 0;
+        inlineFiles = 0;
+        coldFiles = 0;
+        coldBytes = 0;
+        coldStored = 0;
+        demotions = 0;
+        promotions = 0;
+        unsavedReads = 0;
+        generation = 0;
+        cached = false;
+        cacheBlocks = 0;
+        cacheCapacity = 0;
+    }
+};
+
+// Which allocator manages the data region. Picked when an image is formatted.
+enum AllocPolicy {
+    ALLOC_SLAB,   // size-class slabs for small files, first-fit extents for big ones
+    ALLOC_BUDDY   // power-of-two buddy blocks
+};
+
+// What the file system needs from a data region allocator. Each one keeps its
+// own bookkeeping in the allocator area of the directory.
+class DataAllocator {
+public:
+    virtual ~DataAllocator() {}
+
+    virtual AllocPolicy policy() const = 0;
+
+    // Returns the address for size bytes, or -1 if there's no room
+    virtual int allocate(int size) = 0;
+    virtual void release(int address, int size) = 0;
+
+    virtual void save(char* area) const = 0;
+    virtual int savedSize() const = 0;      // bytes save() writes
+    // area is areaSize bytes, files holds (address, size) for every file not stored inline
+    virtual void load(const char* area, int areaSize, const vector<pair<int, int> >& files, int highWaterMark) = 0;
+
+    virtual int getHighWater() const = 0;   // nothing at or past here is in use
+    virtual int freeBytes() const = 0;      // everything not handed out
+    virtual int largestFree() const = 0;    // biggest request that would still succeed
+    virtual void printStats() const = 0;    // extra rows for the statistics screen
+};
+
+// Slot sizes for small files. Anything up to INLINE_LIMIT never gets here.
+const int SIZE_CLASSES[] = { 128, 256, 512, 1024, 2048, 4096 };
+const int NUM_SIZE_CLASSES = 6;
+
+// Data region allocator. Small files get a slot in a slab of their size
+// class (64KB chunks cut into equal slots), so creating and deleting them is
+// a push/pop on a free list and never leaves odd-sized holes behind. Bigger
+// files get first-fit extents from a free list that merges neighbours back
+// together, with a bump pointer at the end of the used space.
+class SlabAllocator : public DataAllocator {
+public:
+    static const int SLAB_SIZE = 64 * 1024;
+
+    SlabAllocator(int start, int end) {
+        regionStart = start;
+        regionEnd = end;
+        highWater = start;
+    }
+
+    AllocPolicy policy() const {
+        return ALLOC_SLAB;
+    }
+
+    int allocate(int size) {
+        int sizeClass = classFor(size);
+        if (sizeClass < 0) {
+            return allocateExtent(size);
+        }
+
+        vector<int>& partial = partialSlabs[sizeClass];
+        if (partial.empty()) {
+            int slabStart = allocateExtent(SLAB_SIZE, SLAB_SIZE);
+            if (slabStart < 0) {
+                // No room for a whole new slab, just give it a plain extent
+                return allocateExtent(size);
+            }
+            addSlab(slabStart, sizeClass);
+        }
+
+        Slab& slab = slabs[partial.back()];
+        int address = slab.freeSlots.back();
+        slab.freeSlots.pop_back();
+        if (slab.freeSlots.empty()) {
+            partial.pop_back();
+        }
+        return address;
+    }
+
+    // Give space back. Slab slots go back on their slab's free list, and a
+    // slab that empties out is returned to the extent list as a whole.
+    void release(int address, int size) {
+        map<int, Slab>::iterator it = slabContaining(address);
+        if (it == slabs.end()) {
+            releaseExtent(address, size);
+            return;
+        }
+
+        Slab& slab = it->second;
+        if (slab.freeSlots.empty()) {
+            partialSlabs[slab.sizeClass].push_back(slab.start);
+        }
+        slab.freeSlots.push_back(address);
+
+        if ((int)slab.freeSlots.size() == slotsPerSlab(slab.sizeClass)) {
+            vector<int>& partial = partialSlabs[slab.sizeClass];
+            partial.erase(find(partial.begin(), partial.end(), slab.start));
+            int start = slab.start;
+            slabs.erase(it);
+            releaseExtent(start, SLAB_SIZE);
+        }
+    }
+
+    // Slab table as stored in the directory area: count, then (start, class) pairs
+    void save(char* area) const {
+        putLE32(area, (unsigned int)slabs.size());
+        int i = 0;
+        for (map<int, Slab>::const_iterator it = slabs.begin(); it != slabs.end(); ++it, ++i) {
+            putLE32(area + 4 + i * 8, it->second.start);
+            putLE32(area + 8 + i * 8, it->second.sizeClass);
+        }
+    }
+
+    int savedSize() const {
+        return 4 + (int)slabs.size() * 8;
+    }
+
+    // Rebuild everything from the saved slab table plus the extents of every
+    // file. Whatever isn't covered by a slab or a file below the high water
+    // mark is free. A table that runs off the area, or has slabs that are
+    // misaligned, outside the region, on top of each other or cutting
+    // through a file, isn't trusted: every file becomes a plain extent.
+    void load(const char* area, int areaSize, const vector<pair<int, int> >& files, int highWaterMark) {
+        highWater = max(regionStart, min(highWaterMark, regionEnd));
+
+        vector<pair<int, int> > used;
+        map<int, vector<bool> > taken;
+        if (!loadTable(area, areaSize, files, taken)) {
+            slabs.clear();
+            taken.clear();
+        }
+        for (map<int, Slab>::iterator it = slabs.begin(); it != slabs.end(); ++it) {
+            used.push_back(make_pair(it->first, (int)SLAB_SIZE));
+        }
+        for (int i = 0; i < (int)files.size(); i++) {
+            map<int, Slab>::iterator it = slabContaining(files[i].first);
+            if (it == slabs.end()) {
+                used.push_back(files[i]);
+            }
+            else {
+                int slot = (files[i].first - it->first) / SIZE_CLASSES[it->second.sizeClass];
+                taken[it->first][slot] = true;
+            }
+        }
+
+        for (map<int, Slab>::iterator it = slabs.begin(); it != slabs.end(); ++it) {
+            Slab& slab = it->second;
+            vector<bool>& slotTaken = taken[slab.start];
+            for (int s = (int)slotTaken.size() - 1; s >= 0; s--) {
+                if (!slotTaken[s]) {
+                    slab.freeSlots.push_back(slab.start + s * SIZE_CLASSES[slab.sizeClass]);
+                }
+            }
+            if (!slab.freeSlots.empty()) {
+                partialSlabs[slab.sizeClass].push_back(slab.start);
+            }
+        }
+
+        sort(used.begin(), used.end());
+        int cursor = regionStart;
+        for (int i = 0; i < (int)used.size(); i++) {
+            if (used[i].first > cursor) {
+                freeExtents[cursor] = used[i].first - cursor;
+            }
+            cursor = max(cursor, used[i].first + used[i].second);
+        }
+        if (cursor < highWater) {
+            freeExtents[cursor] = highWater - cursor;
+        }
+    }
+
+    int getHighWater() const {
+        return highWater;
+    }
+
+    // Holes, the untouched tail, and unused slab slots
+    int freeBytes() const {
+        int total = holeBytes() + (regionEnd - highWater);
+        for (map<int, Slab>::const_iterator it = slabs.begin(); it != slabs.end(); ++it) {
+            total += (int)it->second.freeSlots.size() * SIZE_CLASSES[it->second.sizeClass];
+        }
+        return total;
+    }
+
+    int largestFree() const {
+        int largest = regionEnd - highWater;
+        for (map<int, int>::const_iterator it = freeExtents.begin(); it != freeExtents.end(); ++it) {
+            largest = max(largest, it->second);
+        }
+        return largest;
+    }
+
+    void printStats() const {
+        cout << left << setw(22) << "Allocator:" << "slab + extents\n";
+        cout << left << setw(22) << "Free holes:" << freeExtents.size() << " (" << holeBytes() << " bytes)\n";
+
+        for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+            int slabCount = 0;
+            int usedSlots = 0;
+            for (map<int, Slab>::const_iterator it = slabs.begin(); it != slabs.end(); ++it) {
+                if (it->second.sizeClass == c) {
+                    slabCount++;
+                    usedSlots += slotsPerSlab(c) - (int)it->second.freeSlots.size();
+                }
+            }
+            if (slabCount > 0) {
+                string label = to_string(SIZE_CLASSES[c]) + "B slabs:";
+                cout << left << setw(22) << label << slabCount << " (" << usedSlots << "/"
+                    << slabCount * slotsPerSlab(c) << " slots used)\n";
+            }
+        }
+    }
+
+private:
+    struct Slab {
+        int start;
+        int sizeClass;
+        vector<int> freeSlots;  // addresses of unused slots, lowest on top
+    };
+
+    int regionStart;
+    int regionEnd;
+    int highWater;                          // nothing at or past here is in use
+
+    map<int, int> freeExtents;              // start -> length of holes below highWater
+    map<int, Slab> slabs;                   // slab start -> slab
+    vector<int> partialSlabs[NUM_SIZE_CLASSES];  // slabs with at least one free slot
+
+    static int classFor(int size) {
+        for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+            if (size <= SIZE_CLASSES[c]) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    static int slotsPerSlab(int sizeClass) {
+        return SLAB_SIZE / SIZE_CLASSES[sizeClass];
+    }
+
+    bool loadTable(const char* area, int areaSize, const vector<pair<int, int> >& files,
+                   map<int, vector<bool> >& taken) {
+        slabs.clear();
+        freeExtents.clear();
+        for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+            partialSlabs[c].clear();
+        }
+        if (areaSize < 4) {
+            return false;
+        }
+        long long count = getLE32(area);
+        if (count > (regionEnd - regionStart) / SLAB_SIZE || 4 + count * 8 > areaSize) {
+            return false;
+        }
+
+        for (int i = 0; i < (int)count; i++) {
+            int start = (int)getLE32(area + 4 + i * 8);
+            int sizeClass = (int)getLE32(area + 8 + i * 8);
+            // Aligned slabs can only overlap by starting at the same place
+            if (sizeClass < 0 || sizeClass >= NUM_SIZE_CLASSES || start < regionStart || start > highWater - SLAB_SIZE
+                || (start - regionStart) % SLAB_SIZE != 0 || slabs.count(start) > 0) {
+                return false;
+            }
+            Slab slab;
+            slab.start = start;
+            slab.sizeClass = sizeClass;
+            slabs[start] = slab;
+            taken[start] = vector<bool>(slotsPerSlab(sizeClass), false);
+        }
+
+        // A file either sits in one slot of a slab, or misses every slab
+        for (int i = 0; i < (int)files.size(); i++) {
+            int address = files[i].first;
+            int end = address + files[i].second;
+            map<int, Slab>::iterator it = slabContaining(address);
+            if (it != slabs.end()) {
+                int slotSize = SIZE_CLASSES[it->second.sizeClass];
+                if ((address - it->first) % slotSize != 0 || files[i].second > slotSize) {
+                    return false;
+                }
+                continue;
+            }
+            map<int, Slab>::iterator next = slabs.lower_bound(address);
+            if (next != slabs.end() && next->first < end) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Free bytes sitting in holes below the high water mark
+    int holeBytes() const {
+        int total = 0;
+        for (map<int, int>::const_iterator it = freeExtents.begin(); it != freeExtents.end(); ++it) {
+            total += it->second;
+        }
+        return total;
+    }
+
+    void addSlab(int start, int sizeClass) {
+        Slab slab;
+        slab.start = start;
+        slab.sizeClass = sizeClass;
+        for (int s = slotsPerSlab(sizeClass) - 1; s >= 0; s--) {
+            slab.freeSlots.push_back(start + s * SIZE_CLASSES[sizeClass]);
+        }
+        slabs[start] = slab;
+        partialSlabs[sizeClass].push_back(start);
+    }
+
+    map<int, Slab>::iterator slabContaining(int address) {
+        map<int, Slab>::iterator it = slabs.upper_bound(address);
+        if (it == slabs.begin()) {
+            return slabs.end();
+        }
+        --it;
+        return address < it->first + SLAB_SIZE ? it : slabs.end();
+    }
+
+    // First fit, starting on a multiple of 'align' from the region start.
+    // Whatever gets skipped to line up stays a hole.
+    int allocateExtent(int size, int align = 1) {
+        for (map<int, int>::iterator it = freeExtents.begin(); it != freeExtents.end(); ++it) {
+            int holeStart = it->first;
+            int holeEnd = it->first + it->second;
+            int address = holeStart + (align - (holeStart - regionStart) % align) % align;
+            if (address + size <= holeEnd) {
+                freeExtents.erase(it);
+                if (address > holeStart) {
+                    freeExtents[holeStart] = address - holeStart;
+                }
+                if (holeEnd > address + size) {
+                    freeExtents[address + size] = holeEnd - (address + size);
+                }
+                return address;
+            }
+        }
+
+        int address = highWater + (align - (highWater - regionStart) % align) % align;
+        if (address + size > regionEnd) {
+            return -1;
+        }
+        if (address > highWater) {
+            freeExtents[highWater] = address - highWater;
+        }
+        highWater = address + size;
+        return address;
+    }
+
+    void releaseExtent(int address, int size) {
+        // Merge with the hole right after us
+        map<int, int>::iterator next = freeExtents.find(address + size);
+        if (next != freeExtents.end()) {
+            size += next->second;
+            freeExtents.erase(next);
+        }
+
+        // And the one right before us
+        map<int, int>::iterator prev = freeExtents.lower_bound(address);
+        if (prev != freeExtents.begin()) {
+            --prev;
+            if (prev->first + prev->second == address) {
+                address = prev->first;
+                size += prev->second;
+                freeExtents.erase(prev);
+            }
+        }
+
+        // A hole at the very end just lowers the high water mark
+        if (address + size == highWater) {
+            highWater = address;
+        }
+        else {
+            freeExtents[address] = size;
+        }
+    }
+};
+
+// Buddy system allocator. Every allocation is rounded up to a power of two,
+// and a freed block merges with its "buddy" (the other half of the block it
+// was split from) as soon as both are free, so big free blocks come back on
+// their own. The free lists are saved as-is in the allocator area.
+class BuddyAllocator : public DataAllocator {
+public:
+    static const int MAGIC = 0x31594442;   // "BDY1", never a valid slab count
+    static const int MIN_ORDER = 7;        // 128 bytes, smaller files are inline
+    static const int MAX_ORDER = 23;       // 8MB
+
+    BuddyAllocator(int start, int end) {
+        regionStart = start;
+        regionSize = end - start;
+        reset();
+    }
+
+    AllocPolicy policy() const {
+        return ALLOC_BUDDY;
+    }
+
+    int allocate(int size) {
+        int order = orderFor(size);
+        if (order > MAX_ORDER) {
+            return -1;
+        }
+
+        // Smallest free block that's big enough
+        int found = order;
+        while (found <= MAX_ORDER && freeLists[found].empty()) {
+            found++;
+        }
+        if (found > MAX_ORDER) {
+            return -1;
+        }
+
+        int offset = *freeLists[found].begin();
+        freeLists[found].erase(freeLists[found].begin());
+
+        // Split it down, keeping the upper halves free
+        while (found > order) {
+            found--;
+            freeLists[found].insert(offset + (1 << found));
+        }
+        return regionStart + offset;
+    }
+
+    void release(int address, int size) {
+        int offset = address - regionStart;
+        int order = orderFor(size);
+
+        while (order < MAX_ORDER) {
+            int buddy = offset ^ (1 << order);
+            int merged = min(offset, buddy);
+            // The region isn't a power of two, so the last blocks have no buddy
+            if (merged + (2 << order) > regionSize) {
+                break;
+            }
+            set<int>::iterator it = freeLists[order].find(buddy);
+            if (it == freeLists[order].end()) {
+                break;
+            }
+            freeLists[order].erase(it);
+            offset = merged;
+            order++;
+        }
+        freeLists[order].insert(offset);
+    }
+
+    // Magic, then for each order: count followed by the free block offsets.
+    // Worst case (every other 128B block free) is ~37k ints, well inside the area.
+    void save(char* area) const {
+        char* out = area;
+        putLE32(out, MAGIC);
+        out += 4;
+        for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+            putLE32(out, (unsigned int)freeLists[order].size());
+            out += 4;
+            for (set<int>::const_iterator it = freeLists[order].begin(); it != freeLists[order].end(); ++it) {
+                putLE32(out, *it);
+                out += 4;
+            }
+        }
+    }
+
+    int savedSize() const {
+        int size = 4;
+        for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+            size += 4 + (int)freeLists[order].size() * 4;
+        }
+        return size;
+    }
+
+    // A table that runs off the area, or has blocks that are misaligned,
+    // outside the region or on top of each other or a file, isn't trusted:
+    // the free lists get worked out from the files instead
+    void load(const char* area, int areaSize, const vector<pair<int, int> >& files, int highWaterMark) {
+        (void)highWaterMark;
+
+        if (!loadTable(area, areaSize, files)) {
+            reset();
+            for (int i = 0; i < (int)files.size(); i++) {
+                claim(files[i].first - regionStart, orderFor(files[i].second));
+            }
+        }
+    }
+
+    // Walk back from the end of the region over free blocks
+    int getHighWater() const {
+        int end = regionSize;
+        bool moved = true;
+        while (moved && end > 0) {
+            moved = false;
+            for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+                if (end >= (1 << order) && freeLists[order].count(end - (1 << order)) > 0) {
+                    end -= 1 << order;
+                    moved = true;
+                    break;
+                }
+            }
+        }
+        return regionStart + end;
+    }
+
+    int freeBytes() const {
+        int total = 0;
+        for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+            total += (int)freeLists[order].size() << order;
+        }
+        return total;
+    }
+
+    int largestFree() const {
+        for (int order = MAX_ORDER; order >= MIN_ORDER; order--) {
+            if (!freeLists[order].empty()) {
+                return 1 << order;
+            }
+        }
+        return 0;
+    }
+
+    void printStats() const {
+        cout << left << setw(22) << "Allocator:" << "buddy\n";
+        for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+            if (!freeLists[order].empty()) {
+                string label = "Free " + to_string(1 << order) + "B:";
+                cout << left << setw(22) << label << freeLists[order].size() << " blocks\n";
+            }
+        }
+    }
+
+private:
+    int regionStart;
+    int regionSize;
+    set<int> freeLists[MAX_ORDER + 1];    // offsets (from regionStart) of free blocks per order
+
+    static int orderFor(int size) {
+        int order = MIN_ORDER;
+        while (order <= MAX_ORDER && (1 << order) < size) {
+            order++;
+        }
+        return order;
+    }
+
+    bool loadTable(const char* area, int areaSize, const vector<pair<int, int> >& files) {
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            freeLists[order].clear();
+        }
+        if (areaSize < 4 || (int)getLE32(area) != MAGIC) {
+            return false;
+        }
+
+        // (start, end) of every free block and every file, none may overlap
+        vector<pair<long long, long long> > extents;
+        long long in = 4;
+        for (int order = MIN_ORDER; order <= MAX_ORDER; order++) {
+            if (in + 4 > areaSize) {
+                return false;
+            }
+            long long count = getLE32(area + in);
+            in += 4;
+            if (in + count * 4 > areaSize) {
+                return false;
+            }
+            for (long long i = 0; i < count; i++) {
+                int offset = (int)getLE32(area + in);
+                in += 4;
+                if (offset < 0 || offset % (1 << order) != 0 || (long long)offset + (1 << order) > regionSize) {
+                    return false;
+                }
+                freeLists[order].insert(offset);
+                extents.push_back(make_pair((long long)offset, (long long)offset + (1 << order)));
+            }
+        }
+        for (int i = 0; i < (int)files.size(); i++) {
+            long long offset = files[i].first - regionStart;
+            extents.push_back(make_pair(offset, offset + files[i].second));
+        }
+
+        sort(extents.begin(), extents.end());
+        for (int i = 1; i < (int)extents.size(); i++) {
+            if (extents[i].first < extents[i - 1].second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Take the block of 'order' at offset out of whatever free block holds
+    // it, splitting that down. Nothing happens if it isn't free.
+    void claim(int offset, int order) {
+        if (offset < 0 || order > MAX_ORDER || offset % (1 << order) != 0) {
+            return;
+        }
+        int found = order;
+        while (found <= MAX_ORDER && freeLists[found].count(offset & ~((1 << found) - 1)) == 0) {
+            found++;
+        }
+        if (found > MAX_ORDER) {
+            return;
+        }
+        int block = offset & ~((1 << found) - 1);
+        freeLists[found].erase(block);
+        while (found > order) {
+            found--;
+            int half = (offset & (1 << found)) != 0 ? block : block + (1 << found);
+            freeLists[found].insert(half);
+            block = offset & ~((1 << found) - 1);
+        }
+    }
+
+    // Everything free: cut the region into the biggest aligned blocks that fit
+    void reset() {
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            freeLists[order].clear();
+        }
+        int offset = 0;
+        while (regionSize - offset >= (1 << MIN_ORDER)) {
+            int order = MAX_ORDER;
+            while ((1 << order) > regionSize - offset || offset % (1 << order) != 0) {
+                order--;
+            }
+            freeLists[order].insert(offset);
+            offset += 1 << order;
+        }
+    }
+};
+
+// Make the allocator for a policy over the data region [start, end)
+DataAllocator* createAllocator(AllocPolicy policy, int start, int end) {
+    if (policy == ALLOC_BUDDY) {
+        return new BuddyAllocator(start, end);
+    }
+    return new SlabAllocator(start, end);
+}
+
+// Which allocator wrote an allocator area (old images only know slabs)
+AllocPolicy allocPolicyOf(const char* area) {
+    return (int)getLE32(area) == BuddyAllocator::MAGIC ? ALLOC_BUDDY : ALLOC_SLAB;
+}
+
+// Work-stealing pool for maintenance jobs that split up over many files
+// (scrub, search, import). Every worker has its own deque: it takes work from
+// the back of its own and, once that runs dry, steals from the front of
+// somebody else's, so one worker stuck on a big file doesn't hold up the rest.
+// The thread waiting on a job pitches in as well, so a task can start a job
+// of its own without tying up a worker.
+// Foreground work (serving clients) marks itself with a ForegroundScope and
+// the workers pause a moment before each task while any of it is going on.
+class TaskPool {
+public:
+    static const int BACKOFF_US = 200;   // pause per task while foreground work runs
+
+    class ForegroundScope {
+    public:
+        ForegroundScope() {
+            foregroundCount()++;
+        }
+
+        ~ForegroundScope() {
+            foregroundCount()--;
+        }
+    };
+
+    TaskPool(int threadCount) {
+        stopping = false;
+        pending = 0;
+        nextQueue = 0;
+        for (int i = 0; i < max(threadCount, 1); i++) {
+            queues.push_back(new Queue());
+        }
+        for (int i = 0; i < (int)queues.size(); i++) {
+            workers.push_back(thread(&TaskPool::workerLoop, this, i));
+        }
+    }
+
+    ~TaskPool() {
+        {
+            lock_guard<mutex> guard(idleLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int i = 0; i < (int)workers.size(); i++) {
+            workers[i].join();
+        }
+        for (int i = 0; i < (int)queues.size(); i++) {
+            delete queues[i];
+        }
+    }
+
+    // One pool for the whole process, a worker per core
+    static TaskPool& shared() {
+        static TaskPool pool(thread::hardware_concurrency());
+        return pool;
+    }
+
+    int size() const {
+        return workers.size();
+    }
+
+    // Run body(0) .. body(count - 1) on the pool and wait for all of them
+    void parallelFor(int count, const function<void(int)>& body) {
+        if (count <= 0) {
+            return;
+        }
+        Job job;
+        job.remaining = count;
+        unsigned int first = nextQueue++;
+        for (int i = 0; i < count; i++) {
+            Queue& queue = *queues[(first + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back([&body, &job, i]() {
+                body(i);
+                lock_guard<mutex> guard(job.lock);
+                if (--job.remaining == 0) {
+                    job.done.notify_all();
+                }
+            });
+        }
+        pending += count;
+        {
+            lock_guard<mutex> guard(idleLock);
+        }
+        wake.notify_all();
+
+        // Help out until the last task is done
+        while (job.remaining > 0) {
+            function<void()> task;
+            if (takeTask(first % queues.size(), false, task)) {
+                task();
+                continue;
+            }
+            unique_lock<mutex> guard(job.lock);
+            if (job.remaining > 0) {
+                job.done.wait_for(guard, chrono::milliseconds(1));
+            }
+        }
+        lock_guard<mutex> guard(job.lock);   // the last task may still be holding it
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()> > tasks;
+    };
+
+    struct Job {
+        atomic<int> remaining;
+        mutex lock;
+        condition_variable done;
+    };
+
+    vector<Queue*> queues;
+    vector<thread> workers;
+    mutex idleLock;
+    condition_variable wake;
+    atomic<int> pending;              // tasks sitting in any queue
+    atomic<unsigned int> nextQueue;   // where the next job starts handing out tasks
+    bool stopping;                    // guarded by idleLock
+
+    static atomic<int>& foregroundCount() {
+        static atomic<int> count(0);
+        return count;
+    }
+
+    // Own queue from the back (newest, still warm), others from the front
+    bool takeTask(int self, bool own, function<void()>& task) {
+        int count = queues.size();
+        for (int k = 0; k < count; k++) {
+            Queue& queue = *queues[(self + k) % count];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (own && k == 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            pending--;
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int self) {
+        while (true) {
+            function<void()> task;
+            if (takeTask(self, true, task)) {
+                if (foregroundCount() > 0) {
+                    this_thread::sleep_for(chrono::microseconds((int)BACKOFF_US));
+                }
+                task();
+                continue;
+            }
+            unique_lock<mutex> guard(idleLock);
+            if (stopping) {
+                return;
+            }
+            if (pending == 0) {
+                wake.wait(guard);
+            }
+        }
+    }
+};
+
+// Hierarchical timing wheel for file expiry: 4 levels of 64 slots, one
+// second, 64 seconds, ~68 minutes and ~3 days wide. Adding a timer is O(1),
+// and a timer moves down a level at most 3 times before it fires, so the work
+// per expiry stays the same however many files have one. Timers aren't taken
+// out early (a file deleted or given a new expiry leaves its old one behind),
+// whoever gets them back checks they still apply.
+class TimerWheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    TimerWheel() {
+        now = 0;
+        pending = 0;
+    }
+
+    // Forget every timer and start the clock at 'time'
+    void reset(long long time) {
+        for (int level = 0; level < LEVELS; level++) {
+            for (int slot = 0; slot < SLOTS; slot++) {
+                slots[level][slot].clear();
+            }
+        }
+        late.clear();
+        now = time;
+        pending = 0;
+    }
+
+    void add(const string& name, long long when) {
+        Timer timer;
+        timer.name = name;
+        timer.when = when;
+        place(timer);
+        pending++;
+    }
+
+    // Move the clock up to 'time', returns the names whose timers went off
+    vector<string> advance(long long time) {
+        vector<string> fired;
+        while (now < time && pending > (int)late.size()) {
+            now++;
+            // Each time a level wraps, the next level's current slot is due
+            // within the coming lap, so spread it over the levels below
+            for (int level = 1; level < LEVELS; level++) {
+                if ((now >> (SLOT_BITS * (level - 1))) & (SLOTS - 1)) {
+                    break;
+                }
+                vector<Timer> moving;
+                moving.swap(slots[level][(now >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+                for (int i = 0; i < (int)moving.size(); i++) {
+                    place(moving[i]);
+                }
+            }
+
+            vector<Timer>& slot = slots[0][now & (SLOTS - 1)];
+            for (int i = 0; i < (int)slot.size(); i++) {
+                fired.push_back(slot[i].name);
+            }
+            pending -= slot.size();
+            slot.clear();
+        }
+        now = max(now, time);   // nothing left to go off in between
+
+        // Added already due, or due exactly on a tick that moved them down
+        for (int i = 0; i < (int)late.size(); i++) {
+            fired.push_back(late[i].name);
+        }
+        pending -= late.size();
+        late.clear();
+        return fired;
+    }
+
+private:
+    struct Timer {
+        string name;
+        long long when;
+    };
+
+    vector<Timer> slots[LEVELS][SLOTS];
+    vector<Timer> late;     // already due when they were added
+    long long now;
+    int pending;
+
+    void place(const Timer& timer) {
+        long long delta = timer.when - now;
+        if (delta <= 0) {
+            late.push_back(timer);
+            return;
+        }
+        for (int level = 0; level < LEVELS; level++) {
+            long long span = 1LL << (SLOT_BITS * (level + 1));
+            if (delta < span || level == LEVELS - 1) {
+                // Past the top level's reach: park it at the far end, it gets
+                // placed again (still too far, or properly) when that slot wraps
+                long long when = delta < span ? timer.when : now + span - 1;
+                slots[level][(when >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(timer);
+                return;
+            }
+        }
+    }
+};
+
+// Settings picked when the file system is opened
+struct FileSystemOptions {
+    int cacheBlocks;          // 0 = load the whole image into memory (the old way)
+    CachePolicy cachePolicy;  // eviction policy when cacheBlocks > 0
+    bool quiet;               // no banners or create/delete messages, callers go by return values
+    AllocPolicy allocPolicy;  // allocator for a freshly formatted image
+    bool format;              // ignore whatever is in the image and start empty
+    bool deferSaves;          // don't save after every change, the owner calls flush()
+    vector<string> stripePaths;   // spread the data region over these files (new or empty images)
+    int stripeUnit;           // bytes per stripe unit
+    bool tiering;             // move rarely read files out to the compressed cold tier
+    string shareName;         // keep the in-memory image in this shared memory object
+    bool sharedAccess;        // other processes may use the image at the same time
+    bool readOnly;            // map the image and never change or save it
+
+    FileSystemOptions() {
+        cacheBlocks = 0;
+        cachePolicy = POLICY_2Q;
+        quiet = false;
+        allocPolicy = ALLOC_SLAB;
+        format = false;
+        deferSaves = false;
+        stripeUnit = StripeSet::DEFAULT_UNIT;
+        tiering = false;
+        sharedAccess = false;
+        readOnly = false;
+    }
+};
+
+static const int LISTING_ROW_MAX = 160;  // '#', a 99 character name and the size always fit
+
+// Rows first..last-1 of a listing page (limit 0 = to the end)
+void pageBounds(int total, int offset, int limit, int& first, int& last) {
+    first = min(max(offset, 0), total);
+    last = limit > 0 ? min(first + limit, total) : total;
+}
+
+// Print the file table used by "List files": rows offset.. (at most 'limit'
+// of them, 0 = all). The table is formatted into one buffer and written in a
+// single call, iostream formatting per row is what made long listings slow.
+void printListing(const vector<FileEntry>& entries, int capacity, int offset = 0, int limit = 0) {
+    int total = (int)entries.size();
+    int first, last;
+    pageBounds(total, offset, limit, first, last);
+
+    string out;
+    out.reserve(256 + (size_t)(last - first) * LISTING_ROW_MAX);
+    out += "\n=== FILES IN THE SYSTEM ===\n";
+    out += "===================================\n";
+
+    if (total == 0) {
+        out += "** No files found. Storage is empty! **\n";
+        cout.write(out.data(), out.size());
+        return;
+    }
+
+    char row[LISTING_ROW_MAX];
+    snprintf(row, sizeof(row), "%-4s%-40s%s\n", "#", "FILENAME", "SIZE");
+    out += row;
+    out += "-----------------------------------\n";
+
+    for (int i = first; i < last; i++) {
+        size_t used = out.size();
+        out.resize(used + LISTING_ROW_MAX);
+        int length = snprintf(&out[used], LISTING_ROW_MAX, "%-4d%-40s%d bytes\n",
+            i + 1, entries[i].fileName, entries[i].fileSize);
+        out.resize(used + min(length, LISTING_ROW_MAX - 1));
+    }
+    out += "===================================\n";
+    out += "Total files: " + to_string(total) + "/" + to_string(capacity) + "\n";
+    if (first == last) {
+        out += "Nothing past file " + to_string(total) + "\n";
+    }
+    else if (first > 0 || last < total) {
+        out += "Showing " + to_string(first + 1) + "-" + to_string(last);
+        out += last < total ? ", next page: --offset=" + to_string(last) + "\n" : "\n";
+    }
+    cout.write(out.data(), out.size());
+}
+
+// The main file system handler
+class FileSystem {
+private:
+    static const int TOTAL_SIZE = 10 * 1024 * 1024;  // 10MB total space
+    static const int DIR_SIZE = 1 * 1024 * 1024;     // 1MB just for directory stuff
+    static const int DATA_SIZE = 9 * 1024 * 1024;    // 9MB for actual file content
+    static const int MAX_FILES = 100;                // Max number of files allowed
+
+    // Image format, version 2. All numbers little-endian. The directory starts
+    // with a header, 32 bytes:
+    //   0 magic "SIMG"   4 format version   8 file count   12 next free address
+    //  16 entry size     20..31 zero
+    // followed by the entries, laid out field by field (see encodeEntry).
+    // Older images are still read: version 1 had a 16 byte "SFS1" header and
+    // the entries were the raw FileEntry struct of a 64-bit little-endian
+    // build; version 0 had no magic at all. They're saved as version 2.
+    static const int IMAGE_MAGIC = 0x474D4953;       // "SIMG" in the first 4 bytes
+    static const int FORMAT_VERSION = 2;
+    static const int HEADER_SIZE = 32;
+    static const int ENTRY_SIZE = 208;
+    static const int V1_MAGIC = 0x31534653;          // "SFS1"
+    static const int V1_HEADER_SIZE = 16;
+    static const int LEGACY_ENTRY_SIZE = 108;        // entries before inline data existed
+    static const int ALLOC_OFFSET = 512 * 1024;      // allocator bookkeeping, well past the entries
+    static const int STRIPE_OFFSET = DIR_SIZE - 4096; // stripe layout record, at the very end
+    static const int GENERATION_OFFSET = DIR_SIZE - 8; // bumped on every save
+    static const int QUOTA_OFFSET = 256 * 1024;      // namespace quota table, between entries and allocator
+    static const int QUOTA_MAGIC = 0x31415451;       // "QTA1"
+    static const int NAMESPACE_LENGTH = 64;          // longest namespace with a quota, null included
+    static const int QUOTA_RECORD_SIZE = NAMESPACE_LENGTH + 16;
+    static const int MAX_QUOTAS = 1024;
+    static const int XATTR_OFFSET = 384 * 1024;      // user attributes of all files, up to the allocator
+    static const int XATTR_AREA_SIZE = 128 * 1024;
+    static const int XATTR_MAGIC = 0x31544158;       // "XAT1"
+    static const int MAX_XATTR_KEY = 255;
+    static const int MAX_XATTR_VALUE = 1024;
+    static const int SUMS_OFFSET = DIR_SIZE - 64;      // checksums of the metadata above
+    static const int SUMS_MAGIC = 0x314D5553;          // "SUM1"
+    static const int SUMS_COUNT = 10;
+
+    char* storage;                   // Full storage buffer (only the directory part when cached)
+    string diskFileName;            // Filename used to store our "virtual disk"
+    FileEntry directory[MAX_FILES]; // List of file entries
+    int fileCount;                  // How many files we have
+    DataAllocator* allocator;       // Hands out (and takes back) data region space
+
+    BlockCache* cache;              // Data region cache, nullptr when fully loaded
+    DiskFile disk;                  // Open image, only used when cached
+    StripeSet stripes;              // Other files holding the data region, if striped
+    ColdTier coldTier;              // Compressed files that got pushed out of the data region
+    TimerWheel expiries;            // files with an expiry time, rebuilt from the directory on load
+    unordered_map<string, NamespaceUsage> namespaces;  // limits are saved, usage is counted on load
+    // User attributes live outside the entries so the directory stays small
+    map<string, map<string, string> > xattrs;  // file name -> key -> value
+    int xattrBytes;                 // how much of the attribute area they take
+    bool tiering;                   // demote/promote files automatically
+    int accessesSinceAging;         // reads since the access counts were last halved
+    int demotions;
+    int promotions;
+
+    string shareName;               // shared memory object holding storage, empty if private
+
+    // Several processes on one image: every operation locks the directory
+    // region (shared to look, exclusive to change) and first checks the
+    // generation counter to see if somebody else has saved since
+    bool sharedAccess;
+    long long generation;           // counter as of our last load or save
+    int catchUps;                   // times we had to pick up other processes' changes
+
+    class ImageLock {
+    public:
+        ImageLock(FileSystem* owner, bool exclusive, bool catchUp = true) {
+            fs = owner;
+            // Reads on a shared image can't save, so overdue access stats get
+            // a short exclusive lock of their own first
+            if (!exclusive && catchUp && fs->sharedAccess && !fs->readOnly && fs->accessesDue()) {
+                ImageLock flush(fs, true);
+            }
+            locked = fs->sharedAccess && fs->disk.isOpen() && fs->disk.lock(0, DIR_SIZE, exclusive);
+            if (locked && catchUp) {
+                fs->catchUp();
+            }
+            // Every operation starts here, so it's where expired files get
+            // reclaimed and overdue access stats saved (not while other
+            // processes may be reading under a shared lock, and never on a
+            // read-only image, where expired files just stay hidden)
+            if (catchUp && !fs->readOnly && (exclusive || !fs->sharedAccess)) {
+                fs->expireDue();
+                fs->saveAccessesIfDue();
+            }
+        }
+
+        ~ImageLock() {
+            if (locked) {
+                fs->disk.unlock(0, DIR_SIZE);
+            }
+        }
+
+    private:
+        FileSystem* fs;
+        bool locked;
+    };
+    map<int, int> pins;             // data address -> how many readers (pins, open handles) hold it
+    map<int, int> deferredReleases; // address -> size, freed once the last pin goes
+    bool quiet;                     // no banners or create/delete messages
+    bool readOnly;                  // changes are turned away and nothing is ever saved
+    bool mapped;                    // storage is a read-only mapping of the image
+    bool deferSaves;                // leave saving to flush() instead of after every change
+    bool dirty;                     // there are changes flush() hasn't written yet
+    // Reads only touch memory: counters pile up and ride along with the next
+    // save, or get one of their own once they've waited ACCESS_FLUSH_SECONDS
+    int pendingAccesses;            // reads since the last save
+    bool atimeChanged;              // one of them moved an access time
+    long long pendingSince;         // when the first of them happened
+    // On a shared image a catch-up re-reads the directory, which would drop
+    // those counts, so they're also kept here by name and put back after it
+    struct AccessDelta {
+        int count;
+        unsigned int accessedAt;
+    };
+    map<string, AccessDelta> unsavedAccesses;
+
+    // A file opened for ranged reads, remembers where the last read stopped
+    struct OpenFile {
+        bool inUse;
+        FileEntry file;       // copy of the entry (inline files carry their data along)
+        int length;           // readable bytes, the null terminator isn't part of the file
+        int nextOffset;       // where a sequential reader would read next
+        int window;           // current read-ahead size in bytes, 0 = not sequential
+        int prefetchedUpTo;   // absolute address the cache is filled up to
+        vector<char> coldData; // whole file, unpacked, when it's being read from the cold tier
+    };
+    vector<OpenFile> handles;
+    ReadAheadStats readAhead;
+
+    static const int MIN_READAHEAD = 4 * BlockCache::BLOCK_SIZE;     // 16KB
+    static const int MAX_READAHEAD = 256 * BlockCache::BLOCK_SIZE;   // 1MB
+
+    static const int TIER_LOW_WATER = DATA_SIZE / 8;  // keep this much of the data region free
+    static const int PROMOTE_AFTER = 2;               // reads before a cold file comes back
+    static const int AGING_INTERVAL = 256;            // reads between halving every access count
+    static const int PREFETCH_AHEAD = 4;              // directory entries to prefetch in batch lookups
+    static const int SCRUB_BATCH = 32;                // files verified per turn of the volume lock
+    static const int RELATIME_WINDOW = 24 * 3600;     // reads this close together share one access time
+    static const int ACCESS_FLUSH_SECONDS = 300;      // longest access stats wait for a save of their own
+
+public:
+    FileSystem(const string& filename, const FileSystemOptions& options = FileSystemOptions()) {
+        diskFileName = filename;
+        fileCount = 0;
+        cache = nullptr;
+        quiet = options.quiet;
+        readOnly = options.readOnly;
+        mapped = false;
+        deferSaves = options.deferSaves;
+        dirty = false;
+        pendingAccesses = 0;
+        atimeChanged = false;
+        pendingSince = 0;
+        coldTier.setPath(diskFileName + ".cold", readOnly);
+        tiering = options.tiering && !readOnly;  // tiering moves files around
+        accessesSinceAging = 0;
+        demotions = 0;
+        promotions = 0;
+        sharedAccess = options.sharedAccess && !readOnly;
+        generation = 0;
+        catchUps = 0;
+        xattrBytes = 8;
+
+        // A fresh image gets the requested allocator, an existing one keeps its own
+        allocator = createAllocator(options.allocPolicy, DIR_SIZE, TOTAL_SIZE);
+
+        // Read-only: the mapping takes the place of both storage and the cache
+        storage = nullptr;
+        if (readOnly) {
+            loadReadOnly();
+            return;
+        }
+
+        // Cached mode only keeps the directory in memory, data comes in blocks on demand
+        int residentSize = TOTAL_SIZE;
+        if (options.cacheBlocks > 0) {
+            cache = new BlockCache(options.cacheBlocks, options.cachePolicy);
+            residentSize = DIR_SIZE;
+        }
+
+        // Only a fully loaded image can be shared, cached mode has no data in memory
+#ifdef __linux__
+        if (cache == nullptr && !options.shareName.empty()) {
+            storage = mapSharedStorage(options.shareName, residentSize);
+        }
+#endif
+        if (storage == nullptr) {
+            storage = new char[residentSize];
+        }
+
+        // Wipe storage clean
+        for (int i = 0; i < residentSize; i++) {
+            storage[i] = 0;
+        }
+
+        // Try loading old data if it exists
+        if (options.format) {
+            if (cache != nullptr || sharedAccess) {
+                disk.open(diskFileName, TOTAL_SIZE);
+            }
+            // Others may have the image open, they need to see a newer generation
+            if (sharedAccess) {
+                ImageLock guard(this, true, false);
+                generation = generationOnDisk();
+                saveToDisk();
+            }
+            dirty = true;
+        }
+        else {
+            loadFromDisk();
+        }
+
+        // Striping is picked while the image is still empty, after that the
+        // layout recorded in the directory wins
+        if (!options.stripePaths.empty() && !stripes.isOpen()) {
+            if (fileCount > 0) {
+                if (!quiet) {
+                    cout << "*** " << diskFileName << " already has files, not striping it ***\n";
+                }
+            }
+            else if (!stripes.open(options.stripePaths, options.stripeUnit, DATA_SIZE)) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't open the stripe files!\n";
+            }
+            else {
+                dirty = true;   // the directory has to record the layout
+            }
+        }
+    }
+
+    ~FileSystem() {
+        // Nobody can read through a handle or pin any more
+        for (map<int, int>::iterator it = deferredReleases.begin(); it != deferredReleases.end(); ++it) {
+            allocator->release(it->first, it->second);
+            dirty = true;
+        }
+        deferredReleases.clear();
+
+        // Shared images are saved by every change as it happens. Otherwise
+        // only if something changed: a run that just reads leaves the image
+        // alone, unless a read moved an access time (relatime style)
+        if (!sharedAccess && !readOnly && (dirty || atimeChanged || accessesDue())) {
+            saveToDisk();
+        }
+        // Same rule on a shared image, under the lock and on top of what the
+        // other processes saved
+        if (sharedAccess && !readOnly && (atimeChanged || accessesDue())) {
+            ImageLock guard(this, true);
+            if (pendingAccesses > 0) {
+                saveToDisk();
+            }
+        }
+        delete allocator;
+        delete cache;
+#ifndef _WIN32
+        if (mapped) {
+            munmap(storage, TOTAL_SIZE);
+            storage = nullptr;
+        }
+#endif
+#ifdef __linux__
+        if (!shareName.empty()) {
+            munmap(storage, TOTAL_SIZE);
+            shm_unlink(shareName.c_str());
+            storage = nullptr;
+        }
+#endif
+        delete[] storage;
+    }
+
+    // Make a new file with some data, false if it couldn't be stored
+    bool createNewFile(const string& filename, const string& data) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        if (findFile(filename) != nullptr) {
+            reportExists(filename);
+            return false;
+        }
+        if (!addFile(filename, data)) {
+            return false;
+        }
+        persist();
+        return true;
+    }
+
+    // Show the saved files, a page at a time if asked (limit 0 = all)
+    void listFiles(int offset = 0, int limit = 0) {
+        vector<FileEntry> entries;
+        collectEntries(entries);
+        printListing(entries, MAX_FILES, offset, limit);
+    }
+
+    // Append a copy of every directory entry
+    void collectEntries(vector<FileEntry>& out) {
+        ImageLock guard(this, false);
+        long long now = time(nullptr);
+        for (int i = 0; i < fileCount; i++) {
+            if (!directory[i].isExpired(now)) {
+                out.push_back(directory[i]);
+            }
+        }
+    }
+
+    int getCapacity() const {
+        return MAX_FILES;
+    }
+
+    // Write out changes held back by deferred saves
+    void flush() {
+        if (dirty) {
+            saveToDisk();
+            dirty = false;
+        }
+    }
+
+    bool isDirty() const {
+        return dirty;
+    }
+
+    // Check the metadata and every file against their checksums, reading what
+    // is actually on disk. Files are verified in parallel on the task pool,
+    // a batch at a time. 'guard' (if given) is held around each batch so other
+    // threads can use the volume in between, and bytesPerSecond > 0 spreads the
+    // work out so a background scrub doesn't hog the disk or the CPU.
+    ScrubReport scrub(long long bytesPerSecond, mutex* guard = nullptr, const atomic<bool>* cancel = nullptr) {
+        ScrubReport report;
+        vector<string> names;
+        {
+            unique_lock<mutex> held;
+            if (guard != nullptr) {
+                held = unique_lock<mutex>(*guard);
+            }
+            ImageLock image(this, false);
+            if (!openForScrub()) {
+                report.problems.push_back(diskFileName + ": the image is missing or can't be opened");
+                return report;
+            }
+            scrubMetadata(report);
+            for (int i = 0; i < fileCount; i++) {
+                names.push_back(directory[i].fileName);
+            }
+        }
+
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        for (int first = 0; first < (int)names.size(); first += SCRUB_BATCH) {
+            if (cancel != nullptr && *cancel) {
+                break;
+            }
+            vector<string> batch(names.begin() + first, names.begin() + min(first + (int)SCRUB_BATCH, (int)names.size()));
+            {
+                unique_lock<mutex> held;
+                if (guard != nullptr) {
+                    held = unique_lock<mutex>(*guard);
+                }
+                ImageLock image(this, false);
+                scrubFiles(batch, report);
+            }
+
+            // Stay under the budget: sleep off whatever we're ahead of it
+            if (bytesPerSecond > 0) {
+                chrono::duration<double> due((double)report.bytesChecked / bytesPerSecond);
+                chrono::duration<double> spent = chrono::steady_clock::now() - started;
+                if (due > spent) {
+                    this_thread::sleep_for(due - spent);
+                }
+            }
+        }
+        return report;
+    }
+
+    // View what's inside a file
+    void viewFile(const string& filename) {
+        ImageLock guard(this, false);
+        FileEntry* file = findFile(filename);
+        if (file == nullptr) {
+            cout << "\n!!! ERROR: File '" << filename << "' not found! !!!\n";
+            return;
+        }
+
+        recordAccess(file);
+        cout << "\n=== CONTENTS OF '" << filename << "' ===\n";
+        cout << "===================================\n";
+        if (file->isInline()) {
+            cout.write(file->inlineData, file->fileSize - 1);
+        }
+        else if (file->isCold()) {
+            vector<char> contents(file->fileSize);
+            if (!coldTier.get(file->coldOffset, file->coldSize, contents.data(), file->fileSize)) {
+                cout << "!!! ERROR: Couldn't read '" << filename << "' back from the cold tier !!!";
+            }
+            else {
+                cout.write(contents.data(), file->fileSize - 1);
+                promote(file, contents);
+            }
+        }
+        else {
+            vector<char> contents(file->fileSize);
+            readData(file->startAddress, contents.data(), file->fileSize);
+            cout.write(contents.data(), file->fileSize - 1);
+        }
+        cout << "\n===================================\n";
+    }
+
+    // Delete a file from the system, false if there was no such file
+    bool deleteFile(const string& filename) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        // An expired file is already gone as far as anyone can tell, the
+        // timer wheel reclaims it
+        FileEntry* file = findFile(filename);
+        if (file == nullptr) {
+            if (!quiet) {
+                cout << "\n!!! ERROR: File '" << filename << "' not found! !!!\n";
+            }
+            return false;
+        }
+
+        int fileIndex = (int)(file - directory);
+        releaseSpace(directory[fileIndex]);
+        for (int i = fileIndex; i < fileCount - 1; i++) {
+            directory[i] = directory[i + 1];
+        }
+        fileCount--;
+
+        if (!quiet) {
+            cout << "\n>>> File '" << filename << "' has been DELETED! <<<\n";
+        }
+        persist();
+        return true;
+    }
+
+    // Batch calls: every name is looked up in one pass over the directory, the
+    // image is locked once and saved once, however many files are involved.
+    // Results come back in the same order as the names.
+    // ttlSeconds > 0 makes every file in the batch go away that long from now
+    vector<bool> createFiles(const vector<pair<string, string> >& files, int ttlSeconds = 0) {
+        if (refuseChange()) {
+            return vector<bool>(files.size(), false);
+        }
+        ImageLock guard(this, true);
+        long long expiresAt = ttlSeconds > 0 ? (long long)time(nullptr) + ttlSeconds : 0;
+        vector<string> names;
+        for (int i = 0; i < (int)files.size(); i++) {
+            names.push_back(files[i].first);
+        }
+        vector<int> found = lookupAll(names);
+
+        vector<bool> created(files.size(), false);
+        set<string> seen;
+        bool changed = false;
+        for (int i = 0; i < (int)files.size(); i++) {
+            if (found[i] >= 0 || seen.count(files[i].first) > 0) {
+                reportExists(files[i].first);
+                continue;
+            }
+            created[i] = addFile(files[i].first, files[i].second, expiresAt);
+            if (created[i]) {
+                seen.insert(files[i].first);
+                changed = true;
+            }
+        }
+        if (changed) {
+            persist();
+        }
+        return created;
+    }
+
+    vector<FileContents> readFiles(const vector<string>& names) {
+        ImageLock guard(this, false);
+        vector<int> found = lookupAll(names);
+
+        // Go through the data region front to back instead of in request order
+        long long now = time(nullptr);
+        vector<int> order;
+        for (int i = 0; i < (int)names.size(); i++) {
+            if (found[i] >= 0 && !directory[found[i]].isExpired(now)) {
+                order.push_back(i);
+            }
+        }
+        sort(order.begin(), order.end(), [&](int a, int b) {
+            return directory[found[a]].startAddress < directory[found[b]].startAddress;
+        });
+
+        vector<FileContents> results(names.size());
+        for (int i = 0; i < (int)results.size(); i++) {
+            results[i].found = false;
+        }
+        for (int i = 0; i < (int)order.size(); i++) {
+            FileEntry* file = &directory[found[order[i]]];
+            FileContents& result = results[order[i]];
+            recordAccess(file);
+            if (file->isInline()) {
+                result.data.assign(file->inlineData, file->fileSize - 1);
+            }
+            else if (file->isCold()) {
+                vector<char> contents(file->fileSize);
+                if (!coldTier.get(file->coldOffset, file->coldSize, contents.data(), file->fileSize)) {
+                    continue;
+                }
+                result.data.assign(contents.data(), file->fileSize - 1);
+                promote(file, contents);
+            }
+            else {
+                result.data.resize(file->fileSize);
+                readData(file->startAddress, &result.data[0], file->fileSize);
+                result.data.resize(file->fileSize - 1);
+            }
+            result.found = true;
+        }
+        return results;
+    }
+
+    // Every live file with its contents, timestamps and attributes, read front
+    // to back through the data region. Doesn't count as reading the files.
+    vector<ArchivedFile> exportFiles() {
+        ImageLock guard(this, false);
+        long long now = time(nullptr);
+        vector<int> order;
+        for (int i = 0; i < fileCount; i++) {
+            if (!directory[i].isExpired(now)) {
+                order.push_back(i);
+            }
+        }
+        sort(order.begin(), order.end(), [&](int a, int b) {
+            return directory[a].startAddress < directory[b].startAddress;
+        });
+
+        vector<ArchivedFile> files;
+        files.reserve(order.size());
+        for (int i = 0; i < (int)order.size(); i++) {
+            const FileEntry& entry = directory[order[i]];
+            ArchivedFile file;
+            file.name = entry.fileName;
+            if (!readContents(entry, file.data)) {
+                cerr << "!!! ERROR: Couldn't read '" << file.name << "' back from the cold tier, leaving it out !!!\n";
+                continue;
+            }
+            file.expiresAt = entry.expiresAt;
+            file.createdAt = entry.createdAt;
+            file.modifiedAt = entry.modifiedAt;
+            map<string, map<string, string> >::const_iterator found = xattrs.find(file.name);
+            if (found != xattrs.end()) {
+                file.attributes = found->second;
+            }
+            files.push_back(file);
+        }
+        return files;
+    }
+
+    // Bring in archived files, keeping their timestamps, expiry and
+    // attributes, all with one save. Names that are already here stay as they are.
+    vector<bool> importFiles(const vector<ArchivedFile>& files) {
+        if (refuseChange()) {
+            return vector<bool>(files.size(), false);
+        }
+        ImageLock guard(this, true);
+        vector<bool> imported(files.size(), false);
+        bool changed = false;
+        for (int i = 0; i < (int)files.size(); i++) {
+            const ArchivedFile& file = files[i];
+            if (findFile(file.name) != nullptr) {
+                reportExists(file.name);
+                continue;
+            }
+            bool nameFits = !file.name.empty() && file.name.size() < sizeof(directory[0].fileName)
+                && file.name.find('\0') == string::npos;
+            if (!nameFits || !addFile(file.name, file.data, file.expiresAt)) {
+                continue;
+            }
+            // addFile appends, and findFile wouldn't see a file that expired on the way over
+            FileEntry* entry = &directory[fileCount - 1];
+            if (file.createdAt != 0) {
+                entry->createdAt = file.createdAt;
+                entry->modifiedAt = file.modifiedAt;
+            }
+            for (map<string, string>::const_iterator it = file.attributes.begin(); it != file.attributes.end(); ++it) {
+                if (!storeXattr(file.name, it->first, it->second) && !quiet) {
+                    cout << "\n!!! WARNING: Attribute '" << it->first << "' of '" << file.name << "' didn't fit !!!\n";
+                }
+            }
+            imported[i] = true;
+            changed = true;
+        }
+        if (changed) {
+            persist();
+        }
+        return imported;
+    }
+
+    vector<bool> deleteFiles(const vector<string>& names) {
+        if (refuseChange()) {
+            return vector<bool>(names.size(), false);
+        }
+        ImageLock guard(this, true);
+        vector<int> found = lookupAll(names);
+
+        vector<bool> deleted(names.size(), false);
+        vector<bool> doomed(fileCount, false);
+        bool changed = false;
+        for (int i = 0; i < (int)names.size(); i++) {
+            if (found[i] < 0 || doomed[found[i]]) {
+                if (!quiet) {
+                    cout << "\n!!! ERROR: File '" << names[i] << "' not found! !!!\n";
+                }
+                continue;
+            }
+            doomed[found[i]] = true;
+            deleted[i] = true;
+            changed = true;
+            if (!quiet) {
+                cout << "\n>>> File '" << names[i] << "' has been DELETED! <<<\n";
+            }
+        }
+
+        dropEntries(doomed);
+        if (changed) {
+            persist();
+        }
+        return deleted;
+    }
+
+    // Make a file go away by itself 'seconds' from now (0 = keep it for good)
+    bool expireAfter(const string& filename, int seconds) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        FileEntry* file = findFile(filename);
+        if (file == nullptr) {
+            return false;
+        }
+        file->expiresAt = seconds > 0 ? (long long)time(nullptr) + seconds : 0;
+        if (file->expiresAt != 0) {
+            expiries.add(filename, file->expiresAt);
+        }
+        persist();
+        return true;
+    }
+
+    // Reclaim everything whose time is up, returns how many files went.
+    // Operations do this on their own, this is for when nothing else is going on.
+    int expireFiles() {
+        if (readOnly) {
+            return 0;
+        }
+        ImageLock guard(this, true, false);
+        return expireDue();
+    }
+
+    // Limit a namespace to maxFiles files and maxBytes bytes (0 = no limit).
+    // Files already over the limit stay, only new ones are turned away.
+    bool setQuota(const string& name, int maxFiles, long long maxBytes) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        if ((int)name.size() >= NAMESPACE_LENGTH || name.find('/') != string::npos) {
+            return false;
+        }
+        unordered_map<string, NamespaceUsage>::iterator it = namespaces.find(name);
+        if (it == namespaces.end() && maxFiles == 0 && maxBytes == 0) {
+            return true;    // nothing there to lift
+        }
+        if (it == namespaces.end() && countQuotas() >= MAX_QUOTAS) {
+            return false;
+        }
+
+        NamespaceUsage& usage = namespaces[name];
+        usage.name = name;
+        usage.maxFiles = max(maxFiles, 0);
+        usage.maxBytes = max(maxBytes, 0LL);
+        if (usage.files == 0 && usage.maxFiles == 0 && usage.maxBytes == 0) {
+            namespaces.erase(name);
+        }
+        persist();
+        return true;
+    }
+
+    // A copy of a file's entry and its attributes, false if there's no such file
+    bool statFile(const string& filename, FileEntry& entry, map<string, string>& attributes) {
+        ImageLock guard(this, false);
+        FileEntry* file = findFile(filename);
+        if (file == nullptr) {
+            return false;
+        }
+        entry = *file;
+        map<string, map<string, string> >::const_iterator found = xattrs.find(filename);
+        attributes = found == xattrs.end() ? map<string, string>() : found->second;
+        return true;
+    }
+
+    // Attach a small key/value attribute to a file, replacing any old value
+    bool setXattr(const string& filename, const string& key, const string& value) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        if (findFile(filename) == nullptr || !storeXattr(filename, key, value)) {
+            return false;
+        }
+        persist();
+        return true;
+    }
+
+    bool removeXattr(const string& filename, const string& key) {
+        if (refuseChange()) {
+            return false;
+        }
+        ImageLock guard(this, true);
+        map<string, map<string, string> >::iterator file = xattrs.find(filename);
+        if (file == xattrs.end() || file->second.count(key) == 0) {
+            return false;
+        }
+        xattrBytes -= xattrRecordSize(filename, key, file->second[key]);
+        file->second.erase(key);
+        if (file->second.empty()) {
+            xattrs.erase(file);
+        }
+        persist();
+        return true;
+    }
+
+    // Every namespace that has files or a quota, by name
+    vector<NamespaceUsage> namespaceUsage() {
+        ImageLock guard(this, false);
+        vector<NamespaceUsage> out;
+        for (unordered_map<string, NamespaceUsage>::const_iterator it = namespaces.begin(); it != namespaces.end(); ++it) {
+            out.push_back(it->second);
+        }
+        sort(out.begin(), out.end(), [](const NamespaceUsage& a, const NamespaceUsage& b) {
+            return a.name < b.name;
+        });
+        return out;
+    }
+
+    // Open a file for ranged reads. Returns a handle, or -1 if there's no such file.
+    int openFile(const string& filename) {
+        ImageLock guard(this, false);
+        FileEntry* file = findFile(filename);
+        if (file == nullptr) {
+            return -1;
+        }
+        recordAccess(file);
+
+        // Cold files are unpacked once up front, and maybe brought back to the data region
+        vector<char> coldData;
+        if (file->isCold()) {
+            coldData.resize(file->fileSize);
+            if (!coldTier.get(file->coldOffset, file->coldSize, coldData.data(), file->fileSize)) {
+                return -1;
+            }
+            if (promote(file, coldData)) {
+                coldData.clear();
+            }
+        }
+
+        OpenFile handle;
+        handle.inUse = true;
+        handle.file = *file;
+        handle.coldData.swap(coldData);
+        handle.length = file->fileSize - 1;
+        handle.nextOffset = 0;
+        handle.window = 0;
+        handle.prefetchedUpTo = 0;
+        // Like a pin: deleting the file while it's open mustn't hand its
+        // space to somebody else before the handle is closed
+        if (!handle.file.isInline() && !handle.file.isCold()) {
+            pins[handle.file.startAddress]++;
+        }
+
+        for (int i = 0; i < (int)handles.size(); i++) {
+            if (!handles[i].inUse) {
+                handles[i] = handle;
+                return i;
+            }
+        }
+        handles.push_back(handle);
+        return (int)handles.size() - 1;
+    }
+
+    // Read up to length bytes starting at offset. Returns how many bytes were
+    // read (0 at end of file) or -1 for a bad handle, or for a file another
+    // process changed or deleted since it was opened. Reads that pick up where
+    // the previous one stopped grow a read-ahead window, so a streaming reader
+    // finds its next chunk already cached instead of waiting on the disk.
+    int readFile(int handleId, int offset, char* out, int length) {
+        if (handleId < 0 || handleId >= (int)handles.size() || !handles[handleId].inUse || offset < 0) {
+            return -1;
+        }
+
+        OpenFile& handle = handles[handleId];
+        if (offset >= handle.length) {
+            return 0;
+        }
+        length = min(length, handle.length - offset);
+
+        if (handle.file.isInline()) {
+            memcpy(out, handle.file.inlineData + offset, length);
+            return length;
+        }
+        if (handle.file.isCold()) {
+            memcpy(out, handle.coldData.data() + offset, length);
+            return length;
+        }
+
+        // The open only pins the space in this process, on a shared image
+        // somebody else may have reused it by now
+        ImageLock guard(this, false);
+        if (sharedAccess) {
+            FileEntry* current = findFile(handle.file.fileName);
+            if (current == nullptr || current->startAddress != handle.file.startAddress
+                || current->checksum != handle.file.checksum || current->modifiedAt != handle.file.modifiedAt) {
+                return -1;
+            }
+        }
+
+        if (offset == handle.nextOffset) {
+            readAhead.sequentialReads++;
+            handle.window = handle.window == 0 ? MIN_READAHEAD : min(handle.window * 2, (int)MAX_READAHEAD);
+        }
+        else {
+            readAhead.randomReads++;
+            handle.window = 0;
+            handle.prefetchedUpTo = 0;
+        }
+        handle.nextOffset = offset + length;
+
+        if (cache != nullptr && handle.window > 0) {
+            // Never prefetch so much that the window evicts itself before it's
+            // read: what's fetched plus this read (and a block of slack for
+            // alignment) has to fit in what the cache keeps of new blocks
+            int window = min(handle.window, (cache->prefetchLimit() - 1) * BlockCache::BLOCK_SIZE - length);
+            int readEnd = handle.file.startAddress + offset + length;
+            int fileEnd = handle.file.startAddress + handle.length;
+
+            // Top up once the reader is halfway through what we fetched last time
+            if (window > 0 && handle.prefetchedUpTo < min(readEnd + window / 2, fileEnd)) {
+                int from = max(handle.prefetchedUpTo, handle.file.startAddress + offset);
+                int to = min(readEnd + window, fileEnd);
+                prefetch(from, to);
+                handle.prefetchedUpTo = to;
+                readAhead.prefetchCalls++;
+
+                // And let the kernel start on the window after this one in the background
+                if (to < fileEnd) {
+                    dataWillNeed(to, min(window, fileEnd - to));
+                }
+            }
+        }
+
+        readData(handle.file.startAddress + offset, out, length);
+        return length;
+    }
+
+    void closeFile(int handleId) {
+        if (handleId >= 0 && handleId < (int)handles.size() && handles[handleId].inUse) {
+            OpenFile& handle = handles[handleId];
+            handle.inUse = false;
+            handle.coldData.clear();
+            if (!handle.file.isInline() && !handle.file.isCold()) {
+                unpinFile(handle.file.startAddress);
+            }
+        }
+    }
+
+    // Name of the shared memory object clients can map, empty if not shared
+    string getShareName() const {
+        return shareName;
+    }
+
+    int getSharedSize() const {
+        return TOTAL_SIZE;
+    }
+
+    // Lend out where a file's bytes sit in shared storage. Until unpinFile()
+    // that space isn't reused, so a client can read it straight from its mapping.
+    // False if the file doesn't exist or isn't in the data region, and always
+    // on a shared image: other processes don't know about the pin.
+    bool pinFile(const string& filename, int& address, int& length) {
+        if (shareName.empty() || sharedAccess) {
+            return false;
+        }
+        ImageLock guard(this, false);
+        FileEntry* file = findFile(filename);
+        if (file == nullptr || file->isInline() || file->isCold()) {
+            return false;
+        }
+
+        recordAccess(file);
+        address = file->startAddress;
+        length = file->fileSize - 1;
+        pins[address]++;
+        return true;
+    }
+
+    void unpinFile(int address) {
+        map<int, int>::iterator pin = pins.find(address);
+        if (pin == pins.end() || --pin->second > 0) {
+            return;
+        }
+        pins.erase(pin);
+
+        map<int, int>::iterator deferred = deferredReleases.find(address);
+        if (deferred != deferredReleases.end()) {
+            allocator->release(address, deferred->second);
+            deferredReleases.erase(deferred);
+        }
+    }
+
+    // Show cache counters and space usage
+    void showStats() {
+        ImageLock guard(this, false);
+        cout << "\n=== SYSTEM STATISTICS ===\n";
+        cout << "===================================\n";
+        cout << left << setw(22) << "Files:" << fileCount << "/" << MAX_FILES << "\n";
+        cout << left << setw(22) << "Data high water:" << (allocator->getHighWater() - DIR_SIZE) << "/" << DATA_SIZE << " bytes\n";
+        cout << left << setw(22) << "Free space:" << allocator->freeBytes() << " bytes (largest "
+            << allocator->largestFree() << ")\n";
+        allocator->printStats();
+
+        int inlineFiles = 0;
+        for (int i = 0; i < fileCount; i++) {
+            if (directory[i].isInline()) {
+                inlineFiles++;
+            }
+        }
+        cout << left << setw(22) << "Inline files:" << inlineFiles << " (up to " << INLINE_LIMIT << " bytes each)\n";
+
+        int coldFiles = 0;
+        long long coldBytes = 0;
+        long long coldStored = 0;
+        for (int i = 0; i < fileCount; i++) {
+            if (directory[i].isCold()) {
+                coldFiles++;
+                coldBytes += directory[i].fileSize;
+                coldStored += directory[i].coldSize;
+            }
+        }
+        cout << left << setw(22) << "Cold tier:" << coldFiles << " files, " << coldBytes << " bytes stored as "
+            << coldStored << (tiering ? "" : " (tiering off)") << "\n";
+        cout << left << setw(22) << "Demoted/promoted:" << demotions << "/" << promotions << "\n";
+        cout << left << setw(22) << "Unsaved reads:" << pendingAccesses
+            << (atimeChanged ? " (access times moved)" : "") << "\n";
+        if (sharedAccess) {
+            cout << left << setw(22) << "Shared access:" << "generation " << generation << ", caught up "
+                << catchUps << " times\n";
+        }
+        else {
+            cout << left << setw(22) << "Shared access:" << "off\n";
+        }
+        if (stripes.isOpen()) {
+            cout << left << setw(22) << "Striping:" << stripes.count() << " files, "
+                << stripes.getUnitSize() / 1024 << "KB units, " << stripes.getParallelTransfers() << " parallel transfers\n";
+        }
+        else {
+            cout << left << setw(22) << "Striping:" << "off\n";
+        }
+
+        if (cache == nullptr) {
+            cout << left << setw(22) << "Block cache:" << "off (whole image in memory)\n";
+            cout << "===================================\n";
+            return;
+        }
+
+        const CacheStats& stats = cache->getStats();
+        cout << left << setw(22) << "Block cache:" << (cache->getPolicy() == POLICY_2Q ? "2Q" : "LRU")
+            << ", " << cache->size() << "/" << cache->getCapacity() << " blocks\n";
+        cout << left << setw(22) << "Hits:" << stats.hits << "\n";
+        cout << left << setw(22) << "Misses:" << stats.misses << "\n";
+        cout << left << setw(22) << "Hit rate:" << fixed << setprecision(1) << stats.hitRate() * 100 << "%\n";
+        cout << left << setw(22) << "Evictions:" << stats.evictions << "\n";
+        cout << left << setw(22) << "Ghost hits:" << stats.ghostHits << "\n";
+        cout << left << setw(22) << "Promotions:" << stats.promotions << "\n";
+        cout << left << setw(22) << "Sequential reads:" << readAhead.sequentialReads << "\n";
+        cout << left << setw(22) << "Random reads:" << readAhead.randomReads << "\n";
+        cout << left << setw(22) << "Read-ahead calls:" << readAhead.prefetchCalls << "\n";
+        cout << left << setw(22) << "Prefetched blocks:" << readAhead.prefetchedBlocks << "\n";
+        cout << "===================================\n";
+        cout.unsetf(ios::fixed);
+    }
+
+    // showStats() as numbers, appended like collectEntries
+    void collectMetrics(vector<VolumeMetrics>& out) {
+        ImageLock guard(this, false);
+        VolumeMetrics metrics;
+        metrics.files = fileCount;
+        metrics.capacity = MAX_FILES;
+        metrics.dataUsed = allocator->getHighWater() - DIR_SIZE;
+        metrics.dataSize = DATA_SIZE;
+        metrics.freeBytes = allocator->freeBytes();
+        metrics.largestFree = allocator->largestFree();
+        for (int i = 0; i < fileCount; i++) {
+            if (directory[i].isInline()) {
+                metrics.inlineFiles++;
+            }
+            if (directory[i].isCold()) {
+                metrics.coldFiles++;
+                metrics.coldBytes += directory[i].fileSize;
+                metrics.coldStored += directory[i].coldSize;
+            }
+        }
+        metrics.demotions = demotions;
+        metrics.promotions = promotions;
+        metrics.unsavedReads = pendingAccesses;
+        metrics.generation = generation;
+        if (cache != nullptr) {
+            metrics.cached = true;
+            metrics.cacheBlocks = cache->size();
+            metrics.cacheCapacity = cache->getCapacity();
+            metrics.cache = cache->getStats();
+        }
+        metrics.readAhead = readAhead;
+        out.push_back(metrics);
+    }
+
+private:
+    // Read-only volumes turn every change away before anything is touched
+    bool refuseChange() {
+        if (readOnly && !quiet) {
+            cout << "\n!!! ERROR: " << diskFileName << " is open read-only !!!\n";
+        }
+        return readOnly;
+    }
+
+    // Map the image instead of reading it into memory. Only what's actually
+    // read gets paged in, and a private read-only mapping can't reach the
+    // file even by accident. Short or striped images (and Windows) get a
+    // plain copy instead, still never written back.
+    void loadReadOnly() {
+        if (!disk.openReadOnly(diskFileName)) {
+            cerr << "\n!!! CRITICAL ERROR !!! Couldn't open " << diskFileName << "!\n";
+            storage = new char[TOTAL_SIZE]();
+            return;
+        }
+
+        long long imageSize = disk.size();
+        if (imageSize >= TOTAL_SIZE) {
+            storage = disk.mapReadOnly(TOTAL_SIZE);
+            mapped = storage != nullptr;
+        }
+        vector<string> stripePaths;
+        int stripeUnit;
+        if (mapped && StripeSet::loadRecord(storage + STRIPE_OFFSET, stripePaths, stripeUnit)) {
+#ifndef _WIN32
+            munmap(storage, TOTAL_SIZE);    // the data region has to be read in from the stripes
+#endif
+            storage = nullptr;
+            mapped = false;
+        }
+        if (!mapped) {
+            storage = new char[TOTAL_SIZE]();
+            disk.readAt(0, storage, (int)min(max(imageSize, 0LL), (long long)TOTAL_SIZE));
+        }
+
+        vector<string> damaged;
+        checkMetadataSums(storage, damaged);
+        for (int i = 0; i < (int)damaged.size(); i++) {
+            cerr << "!!! " << diskFileName << ": " << damaged[i] << " !!!\n";
+        }
+        if (!damaged.empty() || !parseDirectory()) {
+            cerr << "\n!!! CRITICAL ERROR !!! " << diskFileName << " failed its checks, nothing will be read from it!\n";
+            fileCount = 0;
+            return;
+        }
+        if (!quiet) {
+            cout << ">>> Opened " << diskFileName << " read-only with " << fileCount << " files <<<\n";
+        }
+    }
+
+    // Every metadata table in 'region' against the checksum saved with it,
+    // what doesn't match goes in 'problems'. Images from before metadata
+    // checksums have nothing to check against.
+    static void checkMetadataSums(const char* region, vector<string>& problems) {
+        int sums[SUMS_COUNT];
+        loadSums(region, sums);
+        if (sums[0] != SUMS_MAGIC) {
+            return;
+        }
+        if (sums[1] < V1_HEADER_SIZE || sums[1] > QUOTA_OFFSET || sums[3] < 0 || sums[3] > STRIPE_OFFSET - ALLOC_OFFSET) {
+            problems.push_back("metadata checksum record is damaged");
+            return;
+        }
+        if ((int)crc32(region, sums[1]) != sums[2]) {
+            problems.push_back("directory entries don't match their checksum");
+        }
+        if ((int)crc32(region + ALLOC_OFFSET, sums[3]) != sums[4]) {
+            problems.push_back("allocator table doesn't match its checksum");
+        }
+        if ((int)crc32(region + STRIPE_OFFSET, StripeSet::RECORD_SIZE) != sums[5]) {
+            problems.push_back("stripe record doesn't match its checksum");
+        }
+        if (sums[6] < 0 || sums[6] > 8 + MAX_QUOTAS * QUOTA_RECORD_SIZE
+            || (int)crc32(region + QUOTA_OFFSET, sums[6]) != sums[7]) {
+            problems.push_back("quota table doesn't match its checksum");
+        }
+        if (sums[8] < 0 || sums[8] > XATTR_AREA_SIZE || (int)crc32(region + XATTR_OFFSET, sums[8]) != sums[9]) {
+            problems.push_back("attribute table doesn't match its checksum");
+        }
+    }
+
+    // Enough to trust an entry's name and where its data is, so reads stay inside the image
+    bool entryLooksSane(const FileEntry& entry) const {
+        if (memchr(entry.fileName, '\0', sizeof(entry.fileName)) == nullptr || entry.fileSize <= 0) {
+            return false;
+        }
+        if (entry.isInline()) {
+            return entry.fileSize <= INLINE_LIMIT;
+        }
+        if (entry.isCold()) {
+            return entry.coldOffset >= 0 && entry.coldSize > 0;
+        }
+        return entry.startAddress >= DIR_SIZE && (long long)entry.startAddress + entry.fileSize <= TOTAL_SIZE;
+    }
+
+    // Save after a change, or just remember to if saves are deferred
+    void persist() {
+        if (deferSaves && !sharedAccess) {
+            dirty = true;
+        }
+        else {
+            saveToDisk();
+        }
+    }
+
+#ifdef __linux__
+    // Put storage in a POSIX shared memory object so other processes can map
+    // it read-only. Falls back to private memory (returns nullptr) on failure.
+    char* mapSharedStorage(const string& name, int size) {
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            cerr << "*** Couldn't create shared memory " << name << ", reads won't be shared ***\n";
+            return nullptr;
+        }
+
+        void* mapping = MAP_FAILED;
+        if (ftruncate(fd, size) == 0) {
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            cerr << "*** Couldn't map shared memory " << name << ", reads won't be shared ***\n";
+            return nullptr;
+        }
+
+        shareName = name;
+        return (char*)mapping;
+    }
+#endif
+
+    // Count a read, every so often halving all the counts so old popularity fades.
+    // Not worth a save on its own, the counts go out with the next change.
+    void recordAccess(FileEntry* file) {
+        file->accessCount++;
+        // relatime: the access time only moves for the first read after a
+        // change, or once a day, so most reads have nothing that must be saved
+        long long now = time(nullptr);
+        if (file->accessedAt <= file->modifiedAt || now - file->accessedAt >= RELATIME_WINDOW) {
+            file->accessedAt = (unsigned int)now;
+            atimeChanged = true;
+        }
+        if (pendingAccesses++ == 0) {
+            pendingSince = now;
+        }
+        if (sharedAccess) {
+            map<string, AccessDelta>::iterator delta = unsavedAccesses.find(file->fileName);
+            if (delta == unsavedAccesses.end()) {
+                AccessDelta fresh;
+                fresh.count = 0;
+                fresh.accessedAt = 0;
+                delta = unsavedAccesses.insert(make_pair(string(file->fileName), fresh)).first;
+            }
+            delta->second.count++;
+            delta->second.accessedAt = file->accessedAt;
+        }
+        if (++accessesSinceAging >= AGING_INTERVAL) {
+            for (int i = 0; i < fileCount; i++) {
+                directory[i].accessCount /= 2;
+            }
+            for (map<string, AccessDelta>::iterator it = unsavedAccesses.begin(); it != unsavedAccesses.end(); ++it) {
+                it->second.count /= 2;
+            }
+            accessesSinceAging = 0;
+        }
+    }
+
+    bool accessesDue() const {
+        return pendingAccesses > 0 && time(nullptr) - pendingSince >= ACCESS_FLUSH_SECONDS;
+    }
+
+    // Access stats that have waited long enough go out as one save
+    void saveAccessesIfDue() {
+        if (accessesDue()) {
+            persist();
+        }
+    }
+
+    bool isOpen(const FileEntry& entry) const {
+        for (int i = 0; i < (int)handles.size(); i++) {
+            if (handles[i].inUse && strcmp(handles[i].file.fileName, entry.fileName) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Move the least read file in the data region (read fewer than 'below'
+    // times, never 'keep' or anything open) out to the cold tier
+    bool demoteColdest(int below, int keep) {
+        int victim = -1;
+        for (int i = 0; i < fileCount; i++) {
+            const FileEntry& entry = directory[i];
+            if (i == keep || entry.isInline() || entry.isCold() || entry.accessCount >= below || isOpen(entry)
+                || pins.count(entry.startAddress) > 0) {
+                continue;
+            }
+            // Among equally cold files, the biggest frees the most
+            if (victim < 0 || entry.accessCount < directory[victim].accessCount
+                || (entry.accessCount == directory[victim].accessCount && entry.fileSize > directory[victim].fileSize)) {
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+
+        FileEntry& entry = directory[victim];
+        vector<char> contents(entry.fileSize);
+        readData(entry.startAddress, contents.data(), entry.fileSize);
+
+        int storedSize = 0;
+        int offset = coldTier.put(contents.data(), entry.fileSize, storedSize);
+        if (offset < 0) {
+            return false;
+        }
+
+        allocator->release(entry.startAddress, entry.fileSize);
+        entry.startAddress = -1;
+        entry.coldOffset = offset;
+        entry.coldSize = storedSize;
+        demotions++;
+        return true;
+    }
+
+    // Bring a cold file that keeps getting read back into the data region,
+    // pushing out only files that are read less. False if it stays cold.
+    bool promote(FileEntry* file, const vector<char>& contents) {
+        // Reads only hold a shared lock on a shared image, moving files needs more
+        if (!tiering || sharedAccess || file->accessCount < PROMOTE_AFTER) {
+            return false;
+        }
+
+        int index = (int)(file - directory);
+        int address = allocator->allocate(file->fileSize);
+        while (address < 0 && demoteColdest(file->accessCount, index)) {
+            address = allocator->allocate(file->fileSize);
+        }
+        if (address < 0) {
+            return false;
+        }
+
+        writeData(address, contents.data(), file->fileSize);
+        coldTier.release(file->coldOffset, file->coldSize);
+        file->startAddress = address;
+        file->coldOffset = 0;
+        file->coldSize = 0;
+        promotions++;
+        persist();
+        return true;
+    }
+
+    // The part of a create after the name has been checked, without the save
+    bool addFile(const string& filename, const string& data, long long expiresAt = 0) {
+        if (fileCount >= MAX_FILES) {
+            if (!quiet) {
+                cout << "\n*** SYSTEM LIMIT REACHED: Cannot store more than " << MAX_FILES << " files! ***\n";
+            }
+            return false;
+        }
+
+        if (!withinQuota(filename, data.length())) {
+            if (!quiet) {
+                cout << "\n!!! QUOTA EXCEEDED: No room left in namespace '" << namespaceOf(filename.c_str()) << "' !!!\n";
+            }
+            return false;
+        }
+
+        int dataSize = data.length() + 1; // Include null terminator
+
+        // Tiny files go straight into the directory entry, no data space needed
+        if (dataSize <= INLINE_LIMIT) {
+            FileEntry newFile(filename, 0, dataSize);
+            memcpy(newFile.inlineData, data.c_str(), dataSize);
+            newFile.checksum = checksumOf(data.c_str(), dataSize);
+            newFile.expiresAt = expiresAt;
+            stampNew(newFile);
+            directory[fileCount++] = newFile;
+            account(newFile, 1);
+            if (expiresAt != 0) {
+                expiries.add(filename, expiresAt);
+            }
+
+            if (!quiet) {
+                cout << "\n>>> SUCCESS: File '" << filename << "' created successfully! <<<\n";
+            }
+            return true;
+        }
+
+        // Out of room: push the least read files to the cold tier until it fits
+        int address = allocator->allocate(dataSize);
+        while (address < 0 && tiering && dataSize <= DATA_SIZE && demoteColdest(INT_MAX, -1)) {
+            address = allocator->allocate(dataSize);
+        }
+        if (address < 0) {
+            if (!quiet) {
+                cout << "\n!!! WARNING: STORAGE FULL !!! Not enough room for this file!\n";
+            }
+            return false;
+        }
+
+        // Copy data into storage (c_str() brings the null terminator along)
+        writeData(address, data.c_str(), dataSize);
+
+        // Add to directory
+        FileEntry newFile(filename, address, dataSize);
+        newFile.checksum = checksumOf(data.c_str(), dataSize);
+        newFile.expiresAt = expiresAt;
+        stampNew(newFile);
+        directory[fileCount++] = newFile;
+        account(newFile, 1);
+        if (expiresAt != 0) {
+            expiries.add(filename, expiresAt);
+        }
+
+        // And keep some headroom so the next create doesn't have to wait on demotions
+        while (tiering && allocator->freeBytes() < TIER_LOW_WATER) {
+            if (!demoteColdest(INT_MAX, fileCount - 1)) {
+                break;
+            }
+        }
+
+        if (!quiet) {
+            cout << "\n>>> SUCCESS: File '" << filename << "' created successfully! <<<\n";
+        }
+        return true;
+    }
+
+    // Take out every entry marked in 'doomed', space and all, closing up the
+    // gaps in one sweep
+    void dropEntries(const vector<bool>& doomed) {
+        int kept = 0;
+        for (int i = 0; i < fileCount; i++) {
+            if (doomed[i]) {
+                releaseSpace(directory[i]);
+            }
+            else {
+                if (kept != i) {
+                    directory[kept] = directory[i];
+                }
+                kept++;
+            }
+        }
+        fileCount = kept;
+    }
+
+    // Delete the files whose timers went off, all in one go with one save
+    int expireDue() {
+        long long now = time(nullptr);
+        vector<string> due = expiries.advance(now);
+        if (due.empty()) {
+            return 0;
+        }
+
+        vector<int> found = lookupAll(due);
+        vector<bool> doomed(fileCount, false);
+        int expired = 0;
+        for (int i = 0; i < (int)found.size(); i++) {
+            // A stale timer: the file was deleted, or its expiry moved since
+            if (found[i] < 0 || doomed[found[i]] || !directory[found[i]].isExpired(now)) {
+                continue;
+            }
+            doomed[found[i]] = true;
+            expired++;
+        }
+        if (expired > 0) {
+            dropEntries(doomed);
+            persist();
+        }
+        return expired;
+    }
+
+    void stampNew(FileEntry& entry) {
+        entry.createdAt = (unsigned int)time(nullptr);
+        entry.modifiedAt = entry.createdAt;
+        entry.accessedAt = entry.createdAt;
+    }
+
+    // Attribute area: magic, record count, then for every attribute
+    // name length (1), name, key length (1), key, value length (2), value
+    static int xattrRecordSize(const string& fileName, const string& key, const string& value) {
+        return 4 + fileName.size() + key.size() + value.size();
+    }
+
+    void saveXattrs() {
+        char* area = storage + XATTR_OFFSET;
+        char* out = area + 8;
+        int count = 0;
+        for (map<string, map<string, string> >::const_iterator file = xattrs.begin(); file != xattrs.end(); ++file) {
+            for (map<string, string>::const_iterator attr = file->second.begin(); attr != file->second.end(); ++attr) {
+                *out++ = (char)file->first.size();
+                memcpy(out, file->first.data(), file->first.size());
+                out += file->first.size();
+                *out++ = (char)attr->first.size();
+                memcpy(out, attr->first.data(), attr->first.size());
+                out += attr->first.size();
+                putLE16(out, (unsigned int)attr->second.size());
+                out += 2;
+                memcpy(out, attr->second.data(), attr->second.size());
+                out += attr->second.size();
+                count++;
+            }
+        }
+        putLE32(area, XATTR_MAGIC);
+        putLE32(area + 4, count);
+    }
+
+    void loadXattrs() {
+        xattrs.clear();
+        xattrBytes = 8;
+        const char* area = storage + XATTR_OFFSET;
+        if ((int)getLE32(area) != XATTR_MAGIC) {
+            return;
+        }
+        const unsigned char* in = (const unsigned char*)area + 8;
+        const unsigned char* end = (const unsigned char*)area + XATTR_AREA_SIZE;
+        int count = (int)getLE32(area + 4);
+        for (int i = 0; i < count; i++) {
+            if (in + 1 > end || in + 1 + in[0] + 1 > end) {
+                break;
+            }
+            string fileName((const char*)in + 1, in[0]);
+            in += 1 + in[0];
+            string key((const char*)in + 1, in[0]);
+            in += 1 + in[0];
+            if (in + 2 > end) {
+                break;
+            }
+            unsigned int valueLength = getLE16((const char*)in);
+            if (in + 2 + valueLength > end) {
+                break;
+            }
+            string value((const char*)in + 2, valueLength);
+            in += 2 + valueLength;
+            xattrs[fileName][key] = value;
+            xattrBytes += xattrRecordSize(fileName, key, value);
+        }
+    }
+
+    int xattrTableSize() const {
+        return xattrBytes;
+    }
+
+    // setXattr for a file that's known to exist, without the save
+    bool storeXattr(const string& filename, const string& key, const string& value) {
+        if (key.empty() || (int)key.size() > MAX_XATTR_KEY || (int)value.size() > MAX_XATTR_VALUE) {
+            return false;
+        }
+        map<string, string>& attributes = xattrs[filename];
+        int size = xattrBytes + xattrRecordSize(filename, key, value);
+        if (attributes.count(key) > 0) {
+            size -= xattrRecordSize(filename, key, attributes[key]);
+        }
+        if (size > XATTR_AREA_SIZE) {
+            if (attributes.empty()) {
+                xattrs.erase(filename);
+            }
+            return false;
+        }
+        attributes[key] = value;
+        xattrBytes = size;
+        return true;
+    }
+
+    // The file is going away, and its attributes with it
+    void dropXattrs(const string& fileName) {
+        map<string, map<string, string> >::iterator file = xattrs.find(fileName);
+        if (file == xattrs.end()) {
+            return;
+        }
+        for (map<string, string>::const_iterator attr = file->second.begin(); attr != file->second.end(); ++attr) {
+            xattrBytes -= xattrRecordSize(fileName, attr->first, attr->second);
+        }
+        xattrs.erase(file);
+    }
+
+    int countQuotas() const {
+        int count = 0;
+        for (unordered_map<string, NamespaceUsage>::const_iterator it = namespaces.begin(); it != namespaces.end(); ++it) {
+            if (it->second.maxFiles != 0 || it->second.maxBytes != 0) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    static string namespaceOf(const char* fileName) {
+        const char* slash = strchr(fileName, '/');
+        return slash == nullptr ? string() : string(fileName, slash - fileName);
+    }
+
+    // Keep the namespace totals current as files come and go
+    void account(const FileEntry& entry, int direction) {
+        string name = namespaceOf(entry.fileName);
+        NamespaceUsage& usage = namespaces[name];
+        usage.name = name;
+        usage.files += direction;
+        usage.bytes += (long long)direction * (entry.fileSize - 1);
+        if (usage.files == 0 && usage.maxFiles == 0 && usage.maxBytes == 0) {
+            namespaces.erase(name);
+        }
+    }
+
+    bool withinQuota(const string& filename, int size) {
+        unordered_map<string, NamespaceUsage>::const_iterator it = namespaces.find(namespaceOf(filename.c_str()));
+        if (it == namespaces.end()) {
+            return true;
+        }
+        const NamespaceUsage& usage = it->second;
+        return (usage.maxFiles == 0 || usage.files + 1 <= usage.maxFiles)
+            && (usage.maxBytes == 0 || usage.bytes + size <= usage.maxBytes);
+    }
+
+    // Quota table: magic, count, then (name, max files, unused, max bytes) records
+    void saveQuotas() {
+        char* area = storage + QUOTA_OFFSET;
+        int count = 0;
+        for (unordered_map<string, NamespaceUsage>::const_iterator it = namespaces.begin(); it != namespaces.end(); ++it) {
+            const NamespaceUsage& usage = it->second;
+            if (usage.maxFiles == 0 && usage.maxBytes == 0) {
+                continue;
+            }
+            char* record = area + 8 + count * QUOTA_RECORD_SIZE;
+            memset(record, 0, QUOTA_RECORD_SIZE);
+            strncpy(record, usage.name.c_str(), NAMESPACE_LENGTH - 1);
+            putLE32(record + NAMESPACE_LENGTH, usage.maxFiles);
+            putLE64(record + NAMESPACE_LENGTH + 8, usage.maxBytes);
+            count++;
+        }
+        putLE32(area, QUOTA_MAGIC);
+        putLE32(area + 4, count);
+    }
+
+    int quotaTableSize() const {
+        return 8 + (int)getLE32(storage + QUOTA_OFFSET + 4) * QUOTA_RECORD_SIZE;
+    }
+
+    // Limits from the quota table, then the usage counted from the entries
+    void loadNamespaces() {
+        namespaces.clear();
+        const char* area = storage + QUOTA_OFFSET;
+        int count = (int)getLE32(area + 4);
+        if ((int)getLE32(area) == QUOTA_MAGIC && count >= 0 && count <= MAX_QUOTAS) {
+            for (int i = 0; i < count; i++) {
+                const char* record = area + 8 + i * QUOTA_RECORD_SIZE;
+                string name(record, strnlen(record, NAMESPACE_LENGTH - 1));
+                NamespaceUsage& usage = namespaces[name];
+                usage.name = name;
+                usage.maxFiles = (int)getLE32(record + NAMESPACE_LENGTH);
+                usage.maxBytes = (long long)getLE64(record + NAMESPACE_LENGTH + 8);
+            }
+        }
+        for (int i = 0; i < fileCount; i++) {
+            account(directory[i], 1);
+        }
+    }
+
+    // Hand a file's space (and its share of the namespace) back before its
+    // entry goes away. If somebody is still reading it through shared
+    // memory, the space waits until they're done.
+    void releaseSpace(const FileEntry& entry) {
+        account(entry, -1);
+        dropXattrs(entry.fileName);
+        if (entry.isCold()) {
+            coldTier.release(entry.coldOffset, entry.coldSize);
+        }
+        else if (pins.count(entry.startAddress) > 0) {
+            deferredReleases[entry.startAddress] = entry.fileSize;
+        }
+        else if (!entry.isInline()) {
+            allocator->release(entry.startAddress, entry.fileSize);
+        }
+    }
+
+    // Checksums of the directory entries, allocator table and stripe record,
+    // kept at SUMS_OFFSET. Saved right after the things they cover.
+    void saveMetadataSums() {
+        int directoryLength = HEADER_SIZE + fileCount * ENTRY_SIZE;
+        int allocLength = allocator->savedSize();
+        int sums[SUMS_COUNT];
+        sums[0] = SUMS_MAGIC;
+        sums[1] = directoryLength;
+        sums[2] = (int)crc32(storage, directoryLength);
+        sums[3] = allocLength;
+        sums[4] = (int)crc32(storage + ALLOC_OFFSET, allocLength);
+        sums[5] = (int)crc32(storage + STRIPE_OFFSET, StripeSet::RECORD_SIZE);
+        sums[6] = quotaTableSize();
+        sums[7] = (int)crc32(storage + QUOTA_OFFSET, sums[6]);
+        sums[8] = xattrTableSize();
+        sums[9] = (int)crc32(storage + XATTR_OFFSET, sums[8]);
+        for (int i = 0; i < SUMS_COUNT; i++) {
+            putLE32(storage + SUMS_OFFSET + i * 4, sums[i]);
+        }
+    }
+
+    static void loadSums(const char* region, int* sums) {
+        for (int i = 0; i < SUMS_COUNT; i++) {
+            sums[i] = (int)getLE32(region + SUMS_OFFSET + i * 4);
+        }
+    }
+
+    // The scrub reads back through 'disk', which only cached and shared mode
+    // keep open. Otherwise it's opened read-only: a missing image is a
+    // problem to report, not something to make an empty one for.
+    bool openForScrub() {
+        if (!disk.isOpen() && !disk.openReadOnly(diskFileName)) {
+            return false;
+        }
+        if (dirty) {
+            flush();    // what's on disk has to match the directory we check it against
+        }
+        return true;
+    }
+
+    void scrubMetadata(ScrubReport& report) {
+        vector<char> region(DIR_SIZE);
+        if (!disk.readAt(0, region.data(), DIR_SIZE)) {
+            report.problems.push_back(diskFileName + ": couldn't read the directory");
+            return;
+        }
+        vector<string> damaged;
+        checkMetadataSums(region.data(), damaged);
+        for (int i = 0; i < (int)damaged.size(); i++) {
+            report.problems.push_back(diskFileName + ": " + damaged[i]);
+        }
+    }
+
+    // Verify the files in 'names' that still exist, spread over the task pool
+    void scrubFiles(const vector<string>& names, ScrubReport& report) {
+        vector<int> found = lookupAll(names);
+        vector<FileEntry> entries;
+        for (int i = 0; i < (int)found.size(); i++) {
+            if (found[i] < 0) {
+                continue;   // deleted since the scrub started
+            }
+            if (directory[found[i]].checksum == 0) {
+                report.filesUnverified++;
+                continue;
+            }
+            entries.push_back(directory[found[i]]);
+            if (directory[found[i]].isCold() && !coldTier.open()) {
+                report.problems.push_back(string(directory[found[i]].fileName) + ": cold tier can't be opened");
+                entries.pop_back();
+            }
+        }
+
+        vector<string> problems(entries.size());
+#ifdef _WIN32
+        // The image stream has a single file position there, so one at a time
+        for (int i = 0; i < (int)entries.size(); i++) {
+            problems[i] = verifyFile(entries[i]);
+        }
+#else
+        TaskPool::shared().parallelFor(entries.size(), [&](int i) {
+            problems[i] = verifyFile(entries[i]);
+        });
+#endif
+        for (int i = 0; i < (int)entries.size(); i++) {
+            report.filesChecked++;
+            report.bytesChecked += entries[i].isCold() ? entries[i].coldSize : entries[i].fileSize;
+            if (!problems[i].empty()) {
+                report.problems.push_back(string(entries[i].fileName) + ": " + problems[i]);
+            }
+        }
+    }
+
+    // Runs on pool threads: positioned reads only, nothing here changes the volume
+    string verifyFile(const FileEntry& entry) {
+        vector<char> contents(entry.fileSize);
+        if (entry.isInline()) {
+            memcpy(contents.data(), entry.inlineData, entry.fileSize);
+        }
+        else if (entry.isCold()) {
+            if (!coldTier.get(entry.coldOffset, entry.coldSize, contents.data(), entry.fileSize)) {
+                return "cold copy can't be read or unpacked";
+            }
+        }
+        else if (!dataReadAt(entry.startAddress, contents.data(), entry.fileSize)) {
+            return "read error";
+        }
+        if (checksumOf(contents.data(), entry.fileSize) != entry.checksum) {
+            return "contents don't match the checksum";
+        }
+        return "";
+    }
+
+    // Directory index of each name (-1 if missing) from a single pass. Entries
+    // a few slots ahead are prefetched so the name compares don't wait on memory.
+    vector<int> lookupAll(const vector<string>& names) {
+        unordered_map<string, int> wanted;
+        for (int i = 0; i < (int)names.size(); i++) {
+            wanted[names[i]] = -1;
+        }
+        int left = wanted.size();
+        for (int i = 0; i < fileCount && left > 0; i++) {
+            if (i + PREFETCH_AHEAD < fileCount) {
+                PREFETCH(&directory[i + PREFETCH_AHEAD]);
+            }
+            unordered_map<string, int>::iterator match = wanted.find(directory[i].fileName);
+            if (match != wanted.end() && match->second < 0) {
+                match->second = i;
+                left--;
+            }
+        }
+
+        vector<int> found;
+        for (int i = 0; i < (int)names.size(); i++) {
+            found.push_back(wanted[names[i]]);
+        }
+        return found;
+    }
+
+    void reportExists(const string& filename) {
+        if (!quiet) {
+            cout << "\n!!! ERROR: File '" << filename << "' already exists !!! \n";
+        }
+    }
+
+    // A file's contents wherever they live, without the null terminator.
+    // False only if the cold tier couldn't give them back.
+    bool readContents(const FileEntry& file, string& out) {
+        if (file.isInline()) {
+            out.assign(file.inlineData, file.fileSize - 1);
+            return true;
+        }
+        vector<char> contents(file.fileSize);
+        if (file.isCold()) {
+            if (!coldTier.get(file.coldOffset, file.coldSize, contents.data(), file.fileSize)) {
+                return false;
+            }
+        }
+        else {
+            readData(file.startAddress, contents.data(), file.fileSize);
+        }
+        out.assign(contents.data(), file.fileSize - 1);
+        return true;
+    }
+
+    // Helper to find file by name
+    FileEntry* findFile(const string& filename) {
+        for (int i = 0; i < fileCount; i++) {
+            if (strcmp(directory[i].fileName, filename.c_str()) == 0) {
+                // Expired but not reclaimed yet (only under a shared image lock)
+                if (directory[i].isExpired(time(nullptr))) {
+                    return nullptr;
+                }
+                return &directory[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Copy bytes out of the data region, either from memory or through the cache
+    void readData(int address, char* out, int length) {
+        if (cache == nullptr) {
+            memcpy(out, storage + address, length);
+            return;
+        }
+
+        while (length > 0) {
+            int offset = address % BlockCache::BLOCK_SIZE;
+            int chunk = min(length, BlockCache::BLOCK_SIZE - offset);
+            char* block = loadBlock(address / BlockCache::BLOCK_SIZE);
+
+            memcpy(out, block + offset, chunk);
+            out += chunk;
+            address += chunk;
+            length -= chunk;
+        }
+    }
+
+    // Copy bytes into the data region. Cached mode writes straight through to
+    // the image and patches any copies of those blocks already in the cache.
+    void writeData(int address, const char* data, int length) {
+        if (cache == nullptr) {
+            memcpy(storage + address, data, length);
+            // Other processes read it from the image, not from our memory
+            if (sharedAccess) {
+                dataWriteAt(address, data, length);
+            }
+            return;
+        }
+
+        dataWriteAt(address, data, length);
+
+        while (length > 0) {
+            int offset = address % BlockCache::BLOCK_SIZE;
+            int chunk = min(length, BlockCache::BLOCK_SIZE - offset);
+            char* block = cache->peek(address / BlockCache::BLOCK_SIZE);
+            if (block != nullptr) {
+                memcpy(block + offset, data, chunk);
+            }
+            data += chunk;
+            address += chunk;
+            length -= chunk;
+        }
+    }
+
+    // Data region I/O on the image (cached or shared mode), or the stripe files if there are any
+    bool dataReadAt(long long address, char* out, int length) {
+        if (stripes.isOpen()) {
+            return stripes.readAt(address - DIR_SIZE, out, length);
+        }
+        return disk.readAt(address, out, length);
+    }
+
+    bool dataWriteAt(long long address, const char* data, int length) {
+        if (stripes.isOpen()) {
+            return stripes.writeAt(address - DIR_SIZE, data, length);
+        }
+        return disk.writeAt(address, data, length);
+    }
+
+    void dataWillNeed(long long address, long long length) {
+        if (stripes.isOpen()) {
+            stripes.willNeed(address - DIR_SIZE, length);
+        }
+        else {
+            disk.willNeed(address, length);
+        }
+    }
+
+    // Get a data block from the cache, reading it from the image on a miss
+    char* loadBlock(int blockNo) {
+        char* block = cache->lookup(blockNo);
+        if (block != nullptr) {
+            return block;
+        }
+
+        block = cache->insert(blockNo);
+        dataReadAt((long long)blockNo * BlockCache::BLOCK_SIZE, block, BlockCache::BLOCK_SIZE);
+        return block;
+    }
+
+    // Pull every block in [from, to) that isn't cached yet into the cache,
+    // using one big read per run of missing blocks instead of one per block
+    void prefetch(int from, int to) {
+        int firstBlock = from / BlockCache::BLOCK_SIZE;
+        int lastBlock = (to - 1) / BlockCache::BLOCK_SIZE;
+        vector<char> buffer;
+
+        int blockNo = firstBlock;
+        while (blockNo <= lastBlock) {
+            if (cache->peek(blockNo) != nullptr) {
+                blockNo++;
+                continue;
+            }
+
+            int runEnd = blockNo;
+            while (runEnd + 1 <= lastBlock && cache->peek(runEnd + 1) == nullptr) {
+                runEnd++;
+            }
+
+            int count = runEnd - blockNo + 1;
+            buffer.resize((size_t)count * BlockCache::BLOCK_SIZE);
+            dataReadAt((long long)blockNo * BlockCache::BLOCK_SIZE, buffer.data(), (int)buffer.size());
+            for (int i = 0; i < count; i++) {
+                memcpy(cache->insert(blockNo + i), &buffer[(size_t)i * BlockCache::BLOCK_SIZE], BlockCache::BLOCK_SIZE);
+            }
+
+            readAhead.prefetchedBlocks += count;
+            blockNo = runEnd + 1;
+        }
+    }
+
+    // Load data from the disk file
+    void loadFromDisk() {
+        if (cache != nullptr || sharedAccess) {
+            if (!disk.open(diskFileName, TOTAL_SIZE)) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't open " << diskFileName << "!\n";
+                return;
+            }
+            if (disk.wasCreated()) {
+                if (!quiet) {
+                    cout << "*** No previous data found. Starting fresh! ***\n";
+                }
+                dirty = true;
+                return;
+            }
+
+            ImageLock guard(this, false, false);
+            disk.readAt(0, storage, DIR_SIZE);
+            if (!parseDirectory()) {
+                return;
+            }
+            // Fully loaded shared image: the data comes through the same descriptor
+            // (stripes were read by parseDirectory)
+            if (cache == nullptr && !stripes.isOpen()) {
+                disk.readAt(DIR_SIZE, storage + DIR_SIZE, DATA_SIZE);
+            }
+        }
+        else {
+            ifstream file(diskFileName.c_str(), ios::binary);
+            if (!file) {
+                if (!quiet) {
+                    cout << "*** No previous data found. Starting fresh! ***\n";
+                }
+                dirty = true;
+                return;
+            }
+
+            file.read(storage, TOTAL_SIZE);
+            if (!parseDirectory()) {
+                return;
+            }
+        }
+
+        if (!quiet) {
+            cout << ">>> Loaded file system with " << fileCount << " files successfully! <<<\n";
+        }
+    }
+
+    // Another process saved since we last looked: re-read the directory and
+    // pull in the data of files that are new to us. Files never change once
+    // written, so everything else we hold is still good.
+    void catchUp() {
+        if (generationOnDisk() == generation) {
+            return;
+        }
+
+        vector<FileEntry> known(directory, directory + fileCount);
+        disk.readAt(0, storage, DIR_SIZE);
+        if (!parseDirectory()) {
+            return;
+        }
+
+        for (int i = 0; i < fileCount; i++) {
+            const FileEntry& entry = directory[i];
+            if (entry.isInline() || entry.isCold()) {
+                continue;
+            }
+            // A file deleted and written again can come back with the same
+            // name, size and address, only its checksum and mtime give it away
+            bool seen = false;
+            for (int j = 0; j < (int)known.size() && !seen; j++) {
+                seen = known[j].startAddress == entry.startAddress && known[j].fileSize == entry.fileSize
+                    && known[j].checksum == entry.checksum && known[j].modifiedAt == entry.modifiedAt
+                    && strcmp(known[j].fileName, entry.fileName) == 0;
+            }
+            if (!seen) {
+                reloadData(entry.startAddress, entry.fileSize);
+            }
+        }
+
+        // Our reads since the last save aren't in what we just read
+        for (int i = 0; i < fileCount && !unsavedAccesses.empty(); i++) {
+            map<string, AccessDelta>::iterator delta = unsavedAccesses.find(directory[i].fileName);
+            if (delta != unsavedAccesses.end()) {
+                directory[i].accessCount += delta->second.count;
+                directory[i].accessedAt = max(directory[i].accessedAt, delta->second.accessedAt);
+            }
+        }
+        catchUps++;
+    }
+
+    long long generationOnDisk() {
+        char bytes[8];
+        disk.readAt(GENERATION_OFFSET, bytes, sizeof(bytes));
+        return (long long)getLE64(bytes);
+    }
+
+    // Re-read a range another process wrote, into memory or over any cached blocks
+    void reloadData(int address, int length) {
+        if (cache == nullptr) {
+            dataReadAt(address, storage + address, length);
+            return;
+        }
+
+        int lastBlock = (address + length - 1) / BlockCache::BLOCK_SIZE;
+        for (int blockNo = address / BlockCache::BLOCK_SIZE; blockNo <= lastBlock; blockNo++) {
+            char* block = cache->peek(blockNo);
+            if (block != nullptr) {
+                dataReadAt((long long)blockNo * BlockCache::BLOCK_SIZE, block, BlockCache::BLOCK_SIZE);
+            }
+        }
+    }
+
+    // A version 2 entry, ENTRY_SIZE bytes with no padding:
+    //   0 name (100, null padded)  100 start address  104 size  108 inline data (64)
+    // 172 access count  176 cold offset  180 cold size  184 checksum  188 expires at (8)
+    // 196 created  200 modified  204 accessed
+    static void encodeEntry(const FileEntry& entry, char* out) {
+        size_t nameLength = strnlen(entry.fileName, sizeof(entry.fileName) - 1);
+        memset(out, 0, 100);
+        memcpy(out, entry.fileName, nameLength);
+        putLE32(out + 100, entry.startAddress);
+        putLE32(out + 104, entry.fileSize);
+        memcpy(out + 108, entry.inlineData, INLINE_LIMIT);
+        putLE32(out + 172, entry.accessCount);
+        putLE32(out + 176, entry.coldOffset);
+        putLE32(out + 180, entry.coldSize);
+        putLE32(out + 184, entry.checksum);
+        putLE64(out + 188, entry.expiresAt);
+        putLE32(out + 196, entry.createdAt);
+        putLE32(out + 200, entry.modifiedAt);
+        putLE32(out + 204, entry.accessedAt);
+    }
+
+    // Read an entry of any version. Entries grew a field at a time, so an
+    // older image just stops early and the missing fields stay zero. Version
+    // 1 entries match version 2 up to the checksum, then the struct padding
+    // put the last fields 4 bytes further on.
+    static void decodeEntry(const char* in, int entrySize, int version, FileEntry& entry) {
+        entry = FileEntry();
+        int tail = version == 1 ? 192 : 188;
+        memcpy(entry.fileName, in, min(entrySize, 100));
+        entry.fileName[99] = '\0';
+        if (entrySize >= 108) {
+            entry.startAddress = (int)getLE32(in + 100);
+            entry.fileSize = (int)getLE32(in + 104);
+        }
+        if (entrySize >= 172) {
+            memcpy(entry.inlineData, in + 108, INLINE_LIMIT);
+        }
+        if (entrySize >= 176) {
+            entry.accessCount = (int)getLE32(in + 172);
+        }
+        if (entrySize >= 184) {
+            entry.coldOffset = (int)getLE32(in + 176);
+            entry.coldSize = (int)getLE32(in + 180);
+        }
+        if (entrySize >= 188) {
+            entry.checksum = getLE32(in + 184);
+        }
+        if (entrySize >= tail + 8) {
+            entry.expiresAt = (long long)getLE64(in + tail);
+        }
+        if (entrySize >= tail + 20) {
+            entry.createdAt = getLE32(in + tail + 8);
+            entry.modifiedAt = getLE32(in + tail + 12);
+            entry.accessedAt = getLE32(in + tail + 16);
+        }
+    }
+
+    // Make sense of the directory region in storage. False if it's broken.
+    bool parseDirectory() {
+        // Images from before inline data start straight with the file count
+        // (never more than MAX_FILES) and use the shorter 108 byte entries
+        int version;
+        int entryOffset;
+        int entrySize;
+        int highWater;
+        if ((int)getLE32(storage) == IMAGE_MAGIC) {
+            version = (int)getLE32(storage + 4);
+            fileCount = (int)getLE32(storage + 8);
+            highWater = (int)getLE32(storage + 12);
+            entrySize = (int)getLE32(storage + 16);
+            entryOffset = HEADER_SIZE;
+            if (version > FORMAT_VERSION) {
+                cerr << "\n!!! CRITICAL ERROR !!! " << diskFileName << " is format version " << version
+                    << ", this program only knows up to " << FORMAT_VERSION << "!\n";
+                fileCount = 0;
+                return false;
+            }
+        }
+        else if ((int)getLE32(storage) == V1_MAGIC) {
+            version = 1;
+            fileCount = (int)getLE32(storage + 4);
+            highWater = (int)getLE32(storage + 8);
+            entrySize = (int)getLE32(storage + 12);
+            entryOffset = V1_HEADER_SIZE;
+        }
+        else {
+            version = 0;
+            fileCount = (int)getLE32(storage);
+            highWater = (int)getLE32(storage + 4);
+            entryOffset = 8;
+            entrySize = LEGACY_ENTRY_SIZE;
+        }
+
+        if (fileCount < 0 || fileCount > MAX_FILES || entrySize <= 0
+            || entryOffset + (long long)fileCount * entrySize > QUOTA_OFFSET || highWater > TOTAL_SIZE) {
+            cerr << "\n!!! CRITICAL ERROR !!! " << diskFileName << " has a broken directory!\n";
+            fileCount = 0;
+            return false;
+        }
+        generation = (long long)getLE64(storage + GENERATION_OFFSET);
+
+        // Striped images keep the data region in the files listed in the directory
+        vector<string> stripePaths;
+        int stripeUnit;
+        if (!stripes.isOpen() && StripeSet::loadRecord(storage + STRIPE_OFFSET, stripePaths, stripeUnit)) {
+            if (!stripes.open(stripePaths, stripeUnit, DATA_SIZE, readOnly)) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't open the stripe files of " << diskFileName << "!\n";
+                fileCount = 0;
+                return false;
+            }
+            if (cache == nullptr && !stripes.readAt(0, storage + DIR_SIZE, DATA_SIZE) && readOnly) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't read the stripe files of " << diskFileName << "!\n";
+                stripes.close();
+                fileCount = 0;
+                return false;
+            }
+        }
+
+        // Take what the image has of each entry, anything newer stays zeroed
+        expiries.reset(time(nullptr));
+        for (int i = 0; i < fileCount; i++) {
+            decodeEntry(storage + entryOffset + i * entrySize, entrySize, version, directory[i]);
+            if (!entryLooksSane(directory[i])) {
+                cerr << "\n!!! CRITICAL ERROR !!! " << diskFileName << " has a broken directory entry!\n";
+                fileCount = 0;
+                return false;
+            }
+            if (directory[i].expiresAt != 0) {
+                expiries.add(directory[i].fileName, directory[i].expiresAt);
+            }
+        }
+
+        loadNamespaces();
+        loadXattrs();
+
+        // Work out the free space from the slab table and where the files sit
+        vector<pair<int, int> > extents;
+        vector<pair<int, int> > coldExtents;
+        for (int i = 0; i < fileCount; i++) {
+            if (directory[i].isCold()) {
+                coldExtents.push_back(make_pair(directory[i].coldOffset, directory[i].coldSize));
+            }
+            else if (!directory[i].isInline()) {
+                extents.push_back(make_pair(directory[i].startAddress, directory[i].fileSize));
+            }
+        }
+        coldTier.rebuild(coldExtents);
+        AllocPolicy imagePolicy = allocPolicyOf(storage + ALLOC_OFFSET);
+        if (imagePolicy != allocator->policy()) {
+            delete allocator;
+            allocator = createAllocator(imagePolicy, DIR_SIZE, TOTAL_SIZE);
+        }
+        allocator->load(storage + ALLOC_OFFSET, STRIPE_OFFSET - ALLOC_OFFSET, extents, highWater);
+        return true;
+    }
+
+    // Save everything to the disk file
+    void saveToDisk() {
+        memset(storage, 0, HEADER_SIZE);
+        putLE32(storage, IMAGE_MAGIC);
+        putLE32(storage + 4, FORMAT_VERSION);
+        putLE32(storage + 8, fileCount);
+        putLE32(storage + 12, allocator->getHighWater());
+        putLE32(storage + 16, ENTRY_SIZE);
+
+        for (int i = 0; i < fileCount; i++) {
+            encodeEntry(directory[i], storage + HEADER_SIZE + i * ENTRY_SIZE);
+        }
+        allocator->save(storage + ALLOC_OFFSET);
+        stripes.saveRecord(storage + STRIPE_OFFSET);
+        saveQuotas();
+        saveXattrs();
+        saveMetadataSums();
+        pendingAccesses = 0;
+        atimeChanged = false;
+        unsavedAccesses.clear();
+        generation++;
+        putLE64(storage + GENERATION_OFFSET, generation);
+
+        // Cached or shared: data was already written through, only the directory is left
+        if (cache != nullptr || sharedAccess) {
+            if (!disk.isOpen() || !disk.writeAt(0, storage, DIR_SIZE)) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't save to " << diskFileName << "!\n";
+            }
+            return;
+        }
+
+        ofstream file(diskFileName.c_str(), ios::binary);
+        if (!file) {
+            cerr << "\n!!! CRITICAL ERROR !!! Couldn't save to " << diskFileName << "!\n";
+            return;
+        }
+
+        // Striped: the image only holds the directory, the stripes get the rest
+        if (stripes.isOpen()) {
+            file.write(storage, DIR_SIZE);
+            if (!stripes.writeAt(0, storage + DIR_SIZE, DATA_SIZE)) {
+                cerr << "\n!!! CRITICAL ERROR !!! Couldn't save to the stripe files!\n";
+            }
+        }
+        else {
+            file.write(storage, TOTAL_SIZE);
+        }
+        file.close();
+    }
+};
+
+// Spreads files over several independent volumes, one image file each, by
+// hashing the name. Every volume has its own lock and its own background
+// flusher thread, so writers that land on different volumes never wait on
+// each other, and a burst of changes to one volume shares a single save.
+class ShardedFileSystem {
+public:
+    static const int FLUSH_DELAY_MS = 50;   // how long changes may pile up before a save
+
+    // Volumes are named <baseName>.0, <baseName>.1, ...
+    ShardedFileSystem(const string& baseName, int shardCount, const FileSystemOptions& options) {
+        for (int i = 0; i < shardCount; i++) {
+            // Each volume stripes over its own set of files, F1.i, F2.i, ...
+            FileSystemOptions volumeOptions = options;
+            volumeOptions.deferSaves = true;
+            for (int j = 0; j < (int)volumeOptions.stripePaths.size(); j++) {
+                volumeOptions.stripePaths[j] += "." + to_string(i);
+            }
+
+            Shard* shard = new Shard();
+            shard->fs = new FileSystem(baseName + "." + to_string(i), volumeOptions);
+            shard->stopping = false;
+            shards.push_back(shard);
+        }
+        for (int i = 0; i < shardCount; i++) {
+            shards[i]->flusher = thread(&ShardedFileSystem::flushLoop, this, shards[i]);
+        }
+    }
+
+    ~ShardedFileSystem() {
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            shards[i]->stopping = true;
+            shards[i]->wake.notify_one();
+        }
+        for (int i = 0; i < (int)shards.size(); i++) {
+            shards[i]->flusher.join();
+            delete shards[i]->fs;    // saves whatever is left
+            delete shards[i];
+        }
+    }
+
+    bool createNewFile(const string& filename, const string& data) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        bool created = shard.fs->createNewFile(filename, data);
+        shard.wake.notify_one();
+        return created;
+    }
+
+    bool deleteFile(const string& filename) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        bool deleted = shard.fs->deleteFile(filename);
+        shard.wake.notify_one();
+        return deleted;
+    }
+
+    void viewFile(const string& filename) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        shard.fs->viewFile(filename);
+    }
+
+    // Batches are split by volume, each part runs as one batch on its volume
+    vector<bool> createFiles(const vector<pair<string, string> >& files, int ttlSeconds = 0) {
+        vector<vector<int> > parts(shards.size());
+        for (int i = 0; i < (int)files.size(); i++) {
+            parts[shardIndex(files[i].first)].push_back(i);
+        }
+        vector<bool> created(files.size(), false);
+        for (int s = 0; s < (int)shards.size(); s++) {
+            if (parts[s].empty()) {
+                continue;
+            }
+            vector<pair<string, string> > part;
+            for (int i = 0; i < (int)parts[s].size(); i++) {
+                part.push_back(files[parts[s][i]]);
+            }
+            lock_guard<mutex> guard(shards[s]->lock);
+            vector<bool> done = shards[s]->fs->createFiles(part, ttlSeconds);
+            for (int i = 0; i < (int)done.size(); i++) {
+                created[parts[s][i]] = done[i];
+            }
+            shards[s]->wake.notify_one();
+        }
+        return created;
+    }
+
+    // Volume by volume, each one read front to back
+    vector<ArchivedFile> exportFiles() {
+        vector<ArchivedFile> files;
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            vector<ArchivedFile> part = shards[i]->fs->exportFiles();
+            files.insert(files.end(), part.begin(), part.end());
+        }
+        return files;
+    }
+
+    vector<bool> importFiles(const vector<ArchivedFile>& files) {
+        vector<vector<int> > parts(shards.size());
+        for (int i = 0; i < (int)files.size(); i++) {
+            parts[shardIndex(files[i].name)].push_back(i);
+        }
+        vector<bool> imported(files.size(), false);
+        for (int s = 0; s < (int)shards.size(); s++) {
+            if (parts[s].empty()) {
+                continue;
+            }
+            vector<ArchivedFile> part;
+            for (int i = 0; i < (int)parts[s].size(); i++) {
+                part.push_back(files[parts[s][i]]);
+            }
+            lock_guard<mutex> guard(shards[s]->lock);
+            vector<bool> done = shards[s]->fs->importFiles(part);
+            for (int i = 0; i < (int)done.size(); i++) {
+                imported[parts[s][i]] = done[i];
+            }
+            shards[s]->wake.notify_one();
+        }
+        return imported;
+    }
+
+    vector<FileContents> readFiles(const vector<string>& names) {
+        vector<vector<int> > parts = splitByShard(names);
+        vector<FileContents> results(names.size());
+        for (int s = 0; s < (int)shards.size(); s++) {
+            if (parts[s].empty()) {
+                continue;
+            }
+            vector<string> part;
+            for (int i = 0; i < (int)parts[s].size(); i++) {
+                part.push_back(names[parts[s][i]]);
+            }
+            lock_guard<mutex> guard(shards[s]->lock);
+            vector<FileContents> done = shards[s]->fs->readFiles(part);
+            for (int i = 0; i < (int)done.size(); i++) {
+                results[parts[s][i]] = done[i];
+            }
+        }
+        return results;
+    }
+
+    vector<bool> deleteFiles(const vector<string>& names) {
+        vector<vector<int> > parts = splitByShard(names);
+        vector<bool> deleted(names.size(), false);
+        for (int s = 0; s < (int)shards.size(); s++) {
+            if (parts[s].empty()) {
+                continue;
+            }
+            vector<string> part;
+            for (int i = 0; i < (int)parts[s].size(); i++) {
+                part.push_back(names[parts[s][i]]);
+            }
+            lock_guard<mutex> guard(shards[s]->lock);
+            vector<bool> done = shards[s]->fs->deleteFiles(part);
+            for (int i = 0; i < (int)done.size(); i++) {
+                deleted[parts[s][i]] = done[i];
+            }
+            shards[s]->wake.notify_one();
+        }
+        return deleted;
+    }
+
+    // One table for all volumes
+    void listFiles(int offset = 0, int limit = 0) {
+        vector<FileEntry> entries;
+        collectEntries(entries);
+        printListing(entries, getCapacity(), offset, limit);
+    }
+
+    // Shared memory reads are only offered for a single volume
+    string getShareName() const {
+        return "";
+    }
+
+    int getSharedSize() const {
+        return 0;
+    }
+
+    bool pinFile(const string&, int&, int&) {
+        return false;
+    }
+
+    void unpinFile(int) {
+    }
+
+    bool statFile(const string& filename, FileEntry& entry, map<string, string>& attributes) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        return shard.fs->statFile(filename, entry, attributes);
+    }
+
+    bool setXattr(const string& filename, const string& key, const string& value) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        bool done = shard.fs->setXattr(filename, key, value);
+        shard.wake.notify_one();
+        return done;
+    }
+
+    bool removeXattr(const string& filename, const string& key) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        bool done = shard.fs->removeXattr(filename, key);
+        shard.wake.notify_one();
+        return done;
+    }
+
+    bool expireAfter(const string& filename, int seconds) {
+        Shard& shard = shardFor(filename);
+        lock_guard<mutex> guard(shard.lock);
+        bool found = shard.fs->expireAfter(filename, seconds);
+        shard.wake.notify_one();
+        return found;
+    }
+
+    int expireFiles() {
+        int expired = 0;
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            expired += shards[i]->fs->expireFiles();
+            shards[i]->wake.notify_one();
+        }
+        return expired;
+    }
+
+    // One volume after the other, each under its own lock a batch at a time,
+    // so the volume lock is what 'guard' would have been for a single one
+    ScrubReport scrub(long long bytesPerSecond, mutex* guard = nullptr, const atomic<bool>* cancel = nullptr) {
+        (void)guard;
+        ScrubReport report;
+        for (int i = 0; i < (int)shards.size(); i++) {
+            report.add(shards[i]->fs->scrub(bytesPerSecond, &shards[i]->lock, cancel));
+        }
+        return report;
+    }
+
+    // Save every volume now instead of waiting for the flushers
+    void flush() {
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            shards[i]->fs->flush();
+        }
+    }
+
+    void collectEntries(vector<FileEntry>& out) {
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            shards[i]->fs->collectEntries(out);
+        }
+    }
+
+    int getCapacity() const {
+        int capacity = 0;
+        for (int i = 0; i < (int)shards.size(); i++) {
+            capacity += shards[i]->fs->getCapacity();
+        }
+        return capacity;
+    }
+
+    void showStats() {
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            cout << "\n--- Volume " << i << " of " << shards.size() << " ---";
+            shards[i]->fs->showStats();
+        }
+    }
+
+    // One entry per volume, in volume order
+    void collectMetrics(vector<VolumeMetrics>& out) {
+        for (int i = 0; i < (int)shards.size(); i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            shards[i]->fs->collectMetrics(out);
+        }
+    }
+
+    // Handles carry the volume number in their low part
+    int openFile(const string& filename) {
+        int index = shardIndex(filename);
+        lock_guard<mutex> guard(shards[index]->lock);
+        int handle = shards[index]->fs->openFile(filename);
+        return handle < 0 ? -1 : handle * (int)shards.size() + index;
+    }
+
+    int readFile(int handle, int offset, char* out, int length) {
+        if (handle < 0) {
+            return -1;
+        }
+        Shard& shard = *shards[handle % shards.size()];
+        lock_guard<mutex> guard(shard.lock);
+        return shard.fs->readFile(handle / (int)shards.size(), offset, out, length);
+    }
+
+    void closeFile(int handle) {
+        if (handle < 0) {
+            return;
+        }
+        Shard& shard = *shards[handle % shards.size()];
+        lock_guard<mutex> guard(shard.lock);
+        shard.fs->closeFile(handle / (int)shards.size());
+    }
+
+private:
+    struct Shard {
+        FileSystem* fs;
+        mutex lock;                 // one writer at a time per volume
+        condition_variable wake;    // poked after every change
+        thread flusher;
+        bool stopping;              // tells the flusher to quit, guarded by lock
+    };
+
+    vector<Shard*> shards;
+
+    // FNV-1a, cheap and spreads short names well
+    int shardIndex(const string& filename) const {
+        unsigned int hash = 2166136261u;
+        for (int i = 0; i < (int)filename.length(); i++) {
+            hash = (hash ^ (unsigned char)filename[i]) * 16777619u;
+        }
+        return (int)(hash % shards.size());
+    }
+
+    Shard& shardFor(const string& filename) {
+        return *shards[shardIndex(filename)];
+    }
+
+    // Positions in 'names' that belong to each volume
+    vector<vector<int> > splitByShard(const vector<string>& names) const {
+        vector<vector<int> > parts(shards.size());
+        for (int i = 0; i < (int)names.size(); i++) {
+            parts[shardIndex(names[i])].push_back(i);
+        }
+        return parts;
+    }
+
+    // Wait for a change, give a few more a moment to arrive, then save them all at once
+    void flushLoop(Shard* shard) {
+        unique_lock<mutex> guard(shard->lock);
+        while (true) {
+            while (!shard->stopping && !shard->fs->isDirty()) {
+                shard->wake.wait(guard);
+            }
+            if (shard->stopping) {
+                break;
+            }
+
+            guard.unlock();
+            this_thread::sleep_for(chrono::milliseconds((int)FLUSH_DELAY_MS));
+            guard.lock();
+            shard->fs->flush();
+        }
+    }
+};
+
+// Hold the screen until the user is done reading (no shell for "pause")
+void waitForEnter() {
+    cout << "Press Enter to continue...";
+    cout.flush();
+    string line;
+    getline(cin, line);
+}
+
+// Main menu loop, works with a single volume or the sharded front-end
+template <typename Volume>
+void runMenu(Volume& fs) {
+    int choice;
+    bool running = true;
+
+    while (running) {
+        cout << "\n+===================================+\n";
+        cout << "|   SUPER FILE STORAGE SYSTEM 3000   |\n";
+        cout << "+===================================+\n";
+        cout << "+-----------------------------------+\n";
+        cout << "| 1. Create a new file              |\n";
+        cout << "| 2. List files                     |\n";
+        cout << "| 3. View file contents             |\n";
+        cout << "| 4. Delete file                    |\n";
+        cout << "| 5. Show statistics                |\n";
+        cout << "| 6. Exit                           |\n";
+        cout << "+-----------------------------------+\n";
+        cout << "Enter your choice: ";
+
+        cin >> choice;
+
+        if (cin.fail()) {
+            cin.clear();
+            char c;
+            while ((c = cin.get()) != '\n' && c != EOF) {}
+            cout << "\n!!! CONFUSED !!! That's not a number I recognize! Try again.\n";
+            continue;
+        }
+
+        char c;
+        while ((c = cin.get()) != '\n' && c != EOF) {}
+
+        string filename, data, line;
+
+        switch (choice) {
+        case 1:
+            cout << ">> Enter filename: ";
+            getline(cin, filename);
+
+            cout << ">> Enter file content (type '###END###' to finish):\n";
+            data = "";
+            while (getline(cin, line)) {
+                if (line == "###END###") break;
+                data += line + "\n";
+            }
+
+            fs.createNewFile(filename, data);
+            break;
+
+        case 2:
+            fs.listFiles();
+            waitForEnter();
+            break;
+
+        case 3:
+            fs.listFiles();
+            cout << ">> Enter filename to view: ";
+            getline(cin, filename);
+            fs.viewFile(filename);
+            waitForEnter();
+            break;
+
+        case 4:
+            fs.listFiles();
+            cout << ">> Enter filename to delete: ";
+            getline(cin, filename);
+            fs.deleteFile(filename);
+            break;
+
+        case 5:
+            fs.showStats();
+            waitForEnter();
+            break;
+
+        case 6:
+            cout << "\n*** Thanks for using the SUPER FILE STORAGE SYSTEM 3000! Goodbye! ***\n";
+            running = false;
+            break;
+
+        default:
+            cout << "\n!!! INVALID CHOICE !!! Please select from the menu options (1-6)\n";
+        }
+    }
+}
+
+// Draws block numbers 0..n-1 where low numbers are much more popular (Zipf)
+class ZipfGenerator {
+public:
+    ZipfGenerator(int n, double skew, unsigned seed) : rng(seed), uniform(0.0, 1.0) {
+        cdf.resize(n);
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            sum += 1.0 / pow(i + 1, skew);
+            cdf[i] = sum;
+        }
+        for (int i = 0; i < n; i++) {
+            cdf[i] /= sum;
+        }
+    }
+
+    int next() {
+        double u = uniform(rng);
+        return (int)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+
+private:
+    vector<double> cdf;
+    mt19937 rng;
+    uniform_real_distribution<double> uniform;
+};
+
+// Replays a Zipfian working set with big sequential sweeps mixed in
+// (like listing + reading every file) and reports hit rates per policy
+void runCacheBenchmark() {
+    const int CACHE_BLOCKS = 1000;
+    const int HOT_BLOCKS = 10000;       // size of the Zipf-distributed working set
+    const int ROUNDS = 20;
+    const int ZIPF_PER_ROUND = 50000;   // point reads between sweeps
+    const int SCAN_BLOCKS = 5000;       // one sweep touches this many fresh blocks
+
+    cout << "\n=== BLOCK CACHE BENCHMARK ===\n";
+    cout << "Cache: " << CACHE_BLOCKS << " blocks, working set: " << HOT_BLOCKS
+        << " blocks (Zipf 0.99), " << ROUNDS << " sweeps of " << SCAN_BLOCKS << " blocks\n";
+    cout << "===================================\n";
+    cout << left << setw(8) << "POLICY" << setw(14) << "HIT RATE" << setw(14) << "ZIPF HITS"
+        << setw(14) << "EVICTIONS" << setw(14) << "GHOST HITS" << "TIME\n";
+    cout << "-----------------------------------------------------------------------\n";
+
+    CachePolicy policies[2] = { POLICY_LRU, POLICY_2Q };
+    for (int p = 0; p < 2; p++) {
+        BlockCache cache(CACHE_BLOCKS, policies[p]);
+        ZipfGenerator zipf(HOT_BLOCKS, 0.99, 42);
+        long long zipfHits = 0;
+        long long zipfReads = 0;
+        int nextScanBlock = HOT_BLOCKS;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < ZIPF_PER_ROUND; i++) {
+                int blockNo = zipf.next();
+                zipfReads++;
+                if (cache.lookup(blockNo) != nullptr) {
+                    zipfHits++;
+                }
+                else {
+                    cache.insert(blockNo);
+                }
+            }
+
+            for (int i = 0; i < SCAN_BLOCKS; i++) {
+                int blockNo = nextScanBlock++;
+                if (cache.lookup(blockNo) == nullptr) {
+                    cache.insert(blockNo);
+                }
+            }
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        const CacheStats& stats = cache.getStats();
+        cout << left << setw(8) << (policies[p] == POLICY_2Q ? "2Q" : "LRU")
+            << fixed << setprecision(2)
+            << setw(14) << stats.hitRate() * 100
+            << setw(14) << (double)zipfHits / zipfReads * 100
+            << setw(14) << stats.evictions
+            << setw(14) << stats.ghostHits
+            << setprecision(0) << ms << " ms\n";
+        cout.unsetf(ios::fixed);
+    }
+    cout << "===================================\n";
+}
+
+// Create/delete churn against each allocator over a 9MB data region: mostly
+// small files, some medium and a few big ones, kept around 70% full
+void runAllocBenchmark() {
+    const int REGION_START = 1024 * 1024;
+    const int REGION_END = 10 * 1024 * 1024;
+    const int OPERATIONS = 200000;
+    const long long TARGET_LIVE = (long long)(REGION_END - REGION_START) * 7 / 10;
+
+    cout << "\n=== ALLOCATOR BENCHMARK ===\n";
+    cout << OPERATIONS << " creates/deletes, 70% small (65B-4KB), 25% medium (4-64KB), 5% big (64-512KB)\n";
+    cout << "===================================\n";
+    cout << left << setw(8) << "POLICY" << setw(14) << "OPS/SEC" << setw(12) << "FAILED"
+        << setw(14) << "LIVE BYTES" << setw(14) << "WASTED" << "LARGEST FREE / FREE\n";
+    cout << "---------------------------------------------------------------------------------\n";
+
+    AllocPolicy policies[2] = { ALLOC_SLAB, ALLOC_BUDDY };
+    for (int p = 0; p < 2; p++) {
+        DataAllocator* allocator = createAllocator(policies[p], REGION_START, REGION_END);
+        mt19937 rng(1234);
+        vector<pair<int, int> > live;
+        long long liveBytes = 0;
+        int failed = 0;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int op = 0; op < OPERATIONS; op++) {
+            bool create = live.empty() || (liveBytes < TARGET_LIVE && rng() % 100 < 60) ||
+                (liveBytes >= TARGET_LIVE && rng() % 100 < 20);
+            if (create) {
+                int kind = rng() % 100;
+                int size;
+                if (kind < 70) {
+                    size = 65 + rng() % (4096 - 65);
+                }
+                else if (kind < 95) {
+                    size = 4096 + rng() % (60 * 1024);
+                }
+                else {
+                    size = 64 * 1024 + rng() % (448 * 1024);
+                }
+
+                int address = allocator->allocate(size);
+                if (address < 0) {
+                    failed++;
+                    continue;
+                }
+                live.push_back(make_pair(address, size));
+                liveBytes += size;
+            }
+            else {
+                int victim = rng() % live.size();
+                allocator->release(live[victim].first, live[victim].second);
+                liveBytes -= live[victim].second;
+                live[victim] = live.back();
+                live.pop_back();
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        // Wasted = space that's neither free nor holding file bytes (rounding, slab tails)
+        long long reserved = (REGION_END - REGION_START) - allocator->freeBytes();
+        int freeBytes = allocator->freeBytes();
+        cout << left << setw(8) << (policies[p] == ALLOC_BUDDY ? "buddy" : "slab")
+            << setw(14) << (long long)(OPERATIONS / seconds)
+            << setw(12) << failed
+            << setw(14) << liveBytes
+            << setw(14) << (reserved - liveBytes)
+            << fixed << setprecision(2) << (freeBytes == 0 ? 0.0 : (double)allocator->largestFree() / freeBytes) << "\n";
+        cout.unsetf(ios::fixed);
+
+        delete allocator;
+    }
+    cout << "===================================\n";
+}
+
+// Stream one file to stdout in chunks through the ranged-read API
+template <typename Volume>
+int catFile(Volume& fs, const string& filename) {
+    int handle = fs.openFile(filename);
+    if (handle < 0) {
+        cerr << "!!! ERROR: File '" << filename << "' not found! !!!\n";
+        return 1;
+    }
+
+    const int CHUNK_SIZE = 64 * 1024;
+    vector<char> buffer(CHUNK_SIZE);
+    int offset = 0;
+    int n;
+    while ((n = fs.readFile(handle, offset, buffer.data(), CHUNK_SIZE)) > 0) {
+        cout.write(buffer.data(), n);
+        offset += n;
+    }
+    fs.closeFile(handle);
+    return 0;
+}
+
+// Copy local files in under their base names, all in one batch (one save)
+template <typename Volume>
+int addFiles(Volume& fs, const vector<string>& paths, int ttlSeconds) {
+    // Reading the local files is the slow part, so that happens on the pool
+    vector<pair<string, string> > files(paths.size());
+    vector<char> readable(paths.size(), 0);
+    TaskPool::shared().parallelFor(paths.size(), [&](int i) {
+        ifstream in(paths[i].c_str(), ios::binary);
+        if (in) {
+            size_t slash = paths[i].find_last_of("/\\");
+            files[i].first = slash == string::npos ? paths[i] : paths[i].substr(slash + 1);
+            files[i].second.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+            readable[i] = 1;
+        }
+    });
+    for (int i = 0; i < (int)paths.size(); i++) {
+        if (!readable[i]) {
+            cerr << "!!! ERROR: Can't read '" << paths[i] << "' !!!\n";
+            return 1;
+        }
+    }
+
+    vector<bool> created = fs.createFiles(files, ttlSeconds);
+    int failed = 0;
+    for (int i = 0; i < (int)created.size(); i++) {
+        if (!created[i]) {
+            cerr << "!!! ERROR: Couldn't add '" << files[i].first << "' !!!\n";
+            failed++;
+        }
+    }
+    cout << ">>> Added " << (created.size() - failed) << " of " << created.size() << " files <<<\n";
+    return failed > 0 ? 1 : 0;
+}
+
+// Packed archive of a volume: just the live files back to back, no free
+// space and no padding, then an index so a reader can find any one file
+// without going through the others. Everything little-endian.
+//   header:  magic "SARC" (4) | version (4)
+//   file:    name length (2) | name | expires at (8) | created (4) | modified (4)
+//            | attribute count (2) | (key length (1) | key | value length (2) | value)...
+//            | size (4) | data
+//   index:   (file offset (8) | name length (2) | name)...
+//   trailer: index offset (8) | file count (4) | CRC-32 of all that came before (4) | "SEND" (4)
+// Writing and reading are both one front to back pass, so it can be piped.
+static const int ARCHIVE_MAGIC = 0x43524153;   // "SARC"
+static const int ARCHIVE_END = 0x444E4553;     // "SEND"
+static const int ARCHIVE_VERSION = 1;
+static const int ARCHIVE_TRAILER = 20;
+static const int ARCHIVE_CHUNK = 1024 * 1024;  // written out a chunk at a time
+
+// Buffers the archive, keeps its running CRC and where in it we are
+class ArchiveWriter {
+public:
+    ArchiveWriter(ostream& out) : out(out) {
+        written = 0;
+        crc = 0;
+    }
+
+    void putNumber(unsigned long long value, int bytes) {
+        char encoded[8];
+        putLE64(encoded, value);
+        buffer.append(encoded, bytes);
+    }
+
+    void putBytes(const string& bytes) {
+        buffer += bytes;
+        if (buffer.size() >= (size_t)ARCHIVE_CHUNK) {
+            flush();
+        }
+    }
+
+    long long offset() const {
+        return written + (long long)buffer.size();
+    }
+
+    unsigned int checksum() {
+        flush();
+        return crc;
+    }
+
+    bool flush() {
+        crc = crc32(buffer.data(), (int)buffer.size(), crc);
+        out.write(buffer.data(), buffer.size());
+        written += buffer.size();
+        buffer.clear();
+        return (bool)out;
+    }
+
+private:
+    ostream& out;
+    string buffer;
+    long long written;
+    unsigned int crc;
+};
+
+bool writeArchive(const vector<ArchivedFile>& files, ostream& out) {
+    ArchiveWriter writer(out);
+    writer.putNumber(ARCHIVE_MAGIC, 4);
+    writer.putNumber(ARCHIVE_VERSION, 4);
+
+    vector<long long> offsets;
+    for (int i = 0; i < (int)files.size(); i++) {
+        const ArchivedFile& file = files[i];
+        offsets.push_back(writer.offset());
+        writer.putNumber(file.name.size(), 2);
+        writer.putBytes(file.name);
+        writer.putNumber(file.expiresAt, 8);
+        writer.putNumber(file.createdAt, 4);
+        writer.putNumber(file.modifiedAt, 4);
+        writer.putNumber(file.attributes.size(), 2);
+        for (map<string, string>::const_iterator it = file.attributes.begin(); it != file.attributes.end(); ++it) {
+            writer.putNumber(it->first.size(), 1);
+            writer.putBytes(it->first);
+            writer.putNumber(it->second.size(), 2);
+            writer.putBytes(it->second);
+        }
+        writer.putNumber(file.data.size(), 4);
+        writer.putBytes(file.data);
+    }
+
+    long long indexOffset = writer.offset();
+    for (int i = 0; i < (int)files.size(); i++) {
+        writer.putNumber(offsets[i], 8);
+        writer.putNumber(files[i].name.size(), 2);
+        writer.putBytes(files[i].name);
+    }
+    writer.putNumber(indexOffset, 8);
+    writer.putNumber(files.size(), 4);
+    writer.putNumber(writer.checksum(), 4);
+    writer.putNumber(ARCHIVE_END, 4);
+    return writer.flush();
+}
+
+// Walks part of an archive held in memory, every read checked against the end
+class ArchiveReader {
+public:
+    ArchiveReader(const string& data, long long start, long long end) : data(data) {
+        pos = start;
+        this->end = end;
+        ok = true;
+    }
+
+    unsigned long long number(int bytes) {
+        if (!has(bytes)) {
+            return 0;
+        }
+        char encoded[8] = {0};
+        memcpy(encoded, data.data() + pos, bytes);
+        pos += bytes;
+        return getLE64(encoded);
+    }
+
+    string bytes(long long length) {
+        if (!has(length)) {
+            return "";
+        }
+        string out = data.substr(pos, length);
+        pos += length;
+        return out;
+    }
+
+    long long offset() const {
+        return pos;
+    }
+
+    bool good() const {
+        return ok;
+    }
+
+private:
+    const string& data;
+    long long pos;
+    long long end;
+    bool ok;
+
+    bool has(long long length) {
+        ok = ok && length >= 0 && pos + length <= end;
+        return ok;
+    }
+};
+
+// Read a whole archive in one go and check it front to back, index and all.
+// Nothing is returned unless all of it is intact.
+bool readArchive(istream& in, vector<ArchivedFile>& files, string& error) {
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    long long size = data.size();
+    if (size < 8 + ARCHIVE_TRAILER || (int)getLE32(data.data()) != ARCHIVE_MAGIC) {
+        error = "not an archive";
+        return false;
+    }
+    if ((int)getLE32(data.data() + 4) > ARCHIVE_VERSION) {
+        error = "archive version " + to_string(getLE32(data.data() + 4)) + " is newer than this program";
+        return false;
+    }
+    const char* trailer = data.data() + size - ARCHIVE_TRAILER;
+    if ((int)getLE32(trailer + 16) != ARCHIVE_END) {
+        error = "archive is cut short";
+        return false;
+    }
+    if (crc32(data.data(), (int)(size - ARCHIVE_TRAILER + 8 + 4)) != getLE32(trailer + 12)) {
+        error = "archive is damaged (checksum mismatch)";
+        return false;
+    }
+    long long indexOffset = (long long)getLE64(trailer);
+    long long count = getLE32(trailer + 8);
+    if (indexOffset < 8 || indexOffset > size - ARCHIVE_TRAILER) {
+        error = "archive's index is out of place";
+        return false;
+    }
+
+    ArchiveReader reader(data, 8, indexOffset);
+    vector<long long> offsets;
+    files.clear();
+    while (reader.good() && reader.offset() < indexOffset) {
+        offsets.push_back(reader.offset());
+        ArchivedFile file;
+        file.name = reader.bytes(reader.number(2));
+        file.expiresAt = (long long)reader.number(8);
+        file.createdAt = (unsigned int)reader.number(4);
+        file.modifiedAt = (unsigned int)reader.number(4);
+        int attributes = (int)reader.number(2);
+        for (int i = 0; i < attributes && reader.good(); i++) {
+            string key = reader.bytes(reader.number(1));
+            file.attributes[key] = reader.bytes(reader.number(2));
+        }
+        file.data = reader.bytes(reader.number(4));
+        files.push_back(file);
+    }
+
+    ArchiveReader index(data, indexOffset, size - ARCHIVE_TRAILER);
+    bool matches = reader.good() && (long long)files.size() == count;
+    for (int i = 0; i < (int)files.size() && matches; i++) {
+        matches = (long long)index.number(8) == offsets[i] && index.bytes(index.number(2)) == files[i].name;
+    }
+    if (!matches || !index.good() || index.offset() != size - ARCHIVE_TRAILER) {
+        files.clear();
+        error = "archive's index doesn't match its files";
+        return false;
+    }
+    return true;
+}
+
+// export <archive>: every live file packed into one stream ("-" = stdout)
+template <typename Volume>
+int exportVolume(Volume& fs, const string& path) {
+    vector<ArchivedFile> files = fs.exportFiles();
+    ofstream file;
+    if (path != "-") {
+        file.open(path.c_str(), ios::binary);
+        if (!file) {
+            cerr << "!!! ERROR: Can't write '" << path << "' !!!\n";
+            return 1;
+        }
+    }
+    ostream& out = path == "-" ? cout : file;
+    if (!writeArchive(files, out)) {
+        cerr << "!!! ERROR: Couldn't write the whole archive !!!\n";
+        return 1;
+    }
+    // The archive itself may be going to stdout
+    (path == "-" ? cerr : cout) << ">>> Exported " << files.size() << " files <<<\n";
+    return 0;
+}
+
+// import <archive> reads and checks all of it before the volume is even
+// opened, so a bad archive leaves no trace ("-" = stdin)
+bool loadArchive(const string& path, vector<ArchivedFile>& files) {
+    ifstream file;
+    if (path != "-") {
+        file.open(path.c_str(), ios::binary);
+        if (!file) {
+            cerr << "!!! ERROR: Can't read '" << path << "' !!!\n";
+            return false;
+        }
+    }
+    string error;
+    if (!readArchive(path == "-" ? cin : file, files, error)) {
+        cerr << "!!! ERROR: " << error << " !!!\n";
+        return false;
+    }
+    return true;
+}
+
+// ...and then adds it in one batch
+template <typename Volume>
+int importVolume(Volume& fs, const vector<ArchivedFile>& files) {
+    vector<bool> imported = fs.importFiles(files);
+    int failed = 0;
+    for (int i = 0; i < (int)imported.size(); i++) {
+        if (!imported[i]) {
+            cerr << "!!! ERROR: Couldn't import '" << files[i].name << "' !!!\n";
+            failed++;
+        }
+    }
+    cout << ">>> Imported " << (imported.size() - failed) << " of " << imported.size() << " files <<<\n";
+    return failed > 0 ? 1 : 0;
+}
+
+// Print the name of every file containing 'text'. The contents come out in
+// one batch read, the matching is spread over the pool.
+template <typename Volume>
+int searchFiles(Volume& fs, const string& text) {
+    vector<FileEntry> entries;
+    fs.collectEntries(entries);
+    vector<string> names;
+    for (int i = 0; i < (int)entries.size(); i++) {
+        names.push_back(entries[i].fileName);
+    }
+    vector<FileContents> contents = fs.readFiles(names);
+
+    vector<char> matched(names.size(), 0);
+    TaskPool::shared().parallelFor(names.size(), [&](int i) {
+        matched[i] = contents[i].found && contents[i].data.find(text) != string::npos;
+    });
+
+    int hits = 0;
+    for (int i = 0; i < (int)names.size(); i++) {
+        if (matched[i]) {
+            cout << names[i] << "\n";
+            hits++;
+        }
+    }
+    return hits > 0 ? 0 : 1;
+}
+
+// How list, stat and stats print: the decorated tables for people, or one
+// record per file/volume for scripts
+enum OutputFormat {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,     // one JSON object per line
+    OUTPUT_BINARY    // length-prefixed records, see RecordWriter
+};
+
+// Builds machine-readable records in one buffer and writes them out in one go.
+// JSON lines are {"key":value,...}. Names and values are arbitrary bytes, so
+// strings keep valid UTF-8 as it is and write control characters, DEL and
+// every byte of an invalid sequence as \u00XX, XX being the byte's value.
+// A binary record is
+//   length (4) | field count (1) | fields
+//   field: key length (1) | key | 'i' value (8)
+//                               | 's' length (4) | bytes
+//                               | 'm' count (4) | (length (4) | key | length (4) | value)...
+// with every number little-endian, so the output can be read anywhere.
+class RecordWriter {
+public:
+    RecordWriter(OutputFormat format) {
+        this->format = format;
+        recordStart = 0;
+        fieldCount = 0;
+    }
+
+    ~RecordWriter() {
+        flush();
+    }
+
+    void begin() {
+        recordStart = out.size();
+        fieldCount = 0;
+        if (format == OUTPUT_JSON) {
+            out += '{';
+        }
+        else {
+            out.append(5, '\0');   // length and field count, filled in by end()
+        }
+    }
+
+    void add(const char* key, long long value) {
+        addKey(key);
+        if (format == OUTPUT_JSON) {
+            out += to_string(value);
+        }
+        else {
+            out += 'i';
+            putNumber(value, 8);
+        }
+    }
+
+    void add(const char* key, const string& value) {
+        addKey(key);
+        if (format == OUTPUT_JSON) {
+            addJsonString(value);
+        }
+        else {
+            out += 's';
+            addBytes(value);
+        }
+    }
+
+    void add(const char* key, const map<string, string>& values) {
+        addKey(key);
+        if (format == OUTPUT_JSON) {
+            out += '{';
+            for (map<string, string>::const_iterator it = values.begin(); it != values.end(); ++it) {
+                if (it != values.begin()) {
+                    out += ',';
+                }
+                addJsonString(it->first);
+                out += ':';
+                addJsonString(it->second);
+            }
+            out += '}';
+        }
+        else {
+            out += 'm';
+            putNumber(values.size(), 4);
+            for (map<string, string>::const_iterator it = values.begin(); it != values.end(); ++it) {
+                addBytes(it->first);
+                addBytes(it->second);
+            }
+        }
+    }
+
+    void end() {
+        if (format == OUTPUT_JSON) {
+            out += "}\n";
+            return;
+        }
+        long long length = out.size() - recordStart - 4;
+        for (int i = 0; i < 4; i++) {
+            out[recordStart + i] = (char)(length >> (8 * i));
+        }
+        out[recordStart + 4] = (char)fieldCount;
+    }
+
+    void flush() {
+        cout.write(out.data(), out.size());
+        cout.flush();
+        out.clear();
+    }
+
+private:
+    OutputFormat format;
+    string out;
+    size_t recordStart;
+    int fieldCount;     // at most 255, our records have far fewer
+
+    void addKey(const char* key) {
+        if (format == OUTPUT_JSON) {
+            if (fieldCount > 0) {
+                out += ',';
+            }
+            addJsonString(key);
+            out += ':';
+        }
+        else {
+            out += (char)strlen(key);
+            out += key;
+        }
+        fieldCount++;
+    }
+
+    void putNumber(long long value, int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            out += (char)((unsigned long long)value >> (8 * i));
+        }
+    }
+
+    void addBytes(const string& value) {
+        putNumber(value.size(), 4);
+        out += value;
+    }
+
+    // Quotes, backslashes and control characters escaped, other bytes as they are
+    void addJsonString(const string& value) {
+        out += '"';
+        for (int i = 0; i < (int)value.size(); i++) {
+            unsigned char c = value[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += (char)c;
+            }
+            else if (c == '\n') {
+                out += "\\n";
+            }
+            else if (c < 0x20 || c == 0x7f || (c >= 0x80 && utf8Length(value, i) == 0)) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else if (c >= 0x80) {
+                int length = utf8Length(value, i);
+                out.append(value, i, length);
+                i += length - 1;
+            }
+            else {
+                out += (char)c;
+            }
+        }
+        out += '"';
+    }
+
+    // Bytes in the well-formed UTF-8 sequence at i (no overlong forms,
+    // surrogates or code points past U+10FFFF), 0 if there isn't one
+    static int utf8Length(const string& text, int i) {
+        unsigned char lead = text[i];
+        int length = lead >= 0xc2 && lead <= 0xdf ? 2 : lead >= 0xe0 && lead <= 0xef ? 3 : lead >= 0xf0 && lead <= 0xf4 ? 4 : 0;
+        if (length == 0 || i + length > (int)text.size()) {
+            return 0;
+        }
+        for (int k = 1; k < length; k++) {
+            if (((unsigned char)text[i + k] & 0xc0) != 0x80) {
+                return 0;
+            }
+        }
+        unsigned char second = text[i + 1];
+        if ((lead == 0xe0 && second < 0xa0) || (lead == 0xed && second >= 0xa0)
+            || (lead == 0xf0 && second < 0x90) || (lead == 0xf4 && second >= 0x90)) {
+            return 0;
+        }
+        return length;
+    }
+};
+
+// The fields list and stat have in common. Sizes are the file's own bytes.
+void addEntryFields(RecordWriter& writer, const FileEntry& entry) {
+    writer.add("name", string(entry.fileName));
+    writer.add("size", entry.fileSize - 1);
+    writer.add("stored", string(entry.isInline() ? "inline" : entry.isCold() ? "cold" : "data"));
+    writer.add("created", entry.createdAt);
+    writer.add("modified", entry.modifiedAt);
+    writer.add("accessed", entry.accessedAt);
+    writer.add("reads", entry.accessCount);
+    writer.add("expires", entry.expiresAt);
+    writer.add("checksum", entry.checksum);
+}
+
+// list: the file table, or a record per file on the page
+template <typename Volume>
+int listVolume(Volume& fs, int offset, int limit, OutputFormat output) {
+    if (output == OUTPUT_TEXT) {
+        fs.listFiles(offset, limit);
+        return 0;
+    }
+    vector<FileEntry> entries;
+    fs.collectEntries(entries);
+    int first, last;
+    pageBounds((int)entries.size(), offset, limit, first, last);
+    RecordWriter writer(output);
+    for (int i = first; i < last; i++) {
+        writer.begin();
+        addEntryFields(writer, entries[i]);
+        writer.end();
+    }
+    return 0;
+}
+
+// stats: the statistics screen, or a record per volume
+template <typename Volume>
+int showVolumeStats(Volume& fs, OutputFormat output) {
+    if (output == OUTPUT_TEXT) {
+        fs.showStats();
+        return 0;
+    }
+    vector<VolumeMetrics> volumes;
+    fs.collectMetrics(volumes);
+    RecordWriter writer(output);
+    for (int i = 0; i < (int)volumes.size(); i++) {
+        const VolumeMetrics& m = volumes[i];
+        writer.begin();
+        writer.add("volume", i);
+        writer.add("files", m.files);
+        writer.add("capacity", m.capacity);
+        writer.add("data_used", m.dataUsed);
+        writer.add("data_size", m.dataSize);
+        writer.add("free_bytes", m.freeBytes);
+        writer.add("largest_free", m.largestFree);
+        writer.add("inline_files", m.inlineFiles);
+        writer.add("cold_files", m.coldFiles);
+        writer.add("cold_bytes", m.coldBytes);
+        writer.add("cold_stored", m.coldStored);
+        writer.add("demotions", m.demotions);
+        writer.add("promotions", m.promotions);
+        writer.add("unsaved_reads", m.unsavedReads);
+        writer.add("generation", m.generation);
+        writer.add("cached", m.cached);
+        writer.add("cache_blocks", m.cacheBlocks);
+        writer.add("cache_capacity", m.cacheCapacity);
+        writer.add("cache_hits", m.cache.hits);
+        writer.add("cache_misses", m.cache.misses);
+        writer.add("cache_evictions", m.cache.evictions);
+        writer.add("cache_ghost_hits", m.cache.ghostHits);
+        writer.add("cache_promotions", m.cache.promotions);
+        writer.add("sequential_reads", m.readAhead.sequentialReads);
+        writer.add("random_reads", m.readAhead.randomReads);
+        writer.add("prefetch_calls", m.readAhead.prefetchCalls);
+        writer.add("prefetched_blocks", m.readAhead.prefetchedBlocks);
+        writer.end();
+    }
+    return 0;
+}
+
+// Local date and time, "-" for a timestamp that was never set
+string formatTime(long long seconds) {
+    if (seconds == 0) {
+        return "-";
+    }
+    time_t when = (time_t)seconds;
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    return text;
+}
+
+// Everything the volume knows about one file
+template <typename Volume>
+int statFile(Volume& fs, const string& filename, OutputFormat output) {
+    FileEntry entry;
+    map<string, string> attributes;
+    if (!fs.statFile(filename, entry, attributes)) {
+        cerr << "!!! ERROR: File '" << filename << "' not found! !!!\n";
+        return 1;
+    }
+
+    if (output != OUTPUT_TEXT) {
+        RecordWriter writer(output);
+        writer.begin();
+        addEntryFields(writer, entry);
+        writer.add("address", entry.isInline() ? -1 : entry.isCold() ? entry.coldOffset : entry.startAddress);
+        writer.add("attrs", attributes);
+        writer.end();
+        return 0;
+    }
+
+    cout << "\n=== '" << filename << "' ===\n";
+    cout << "===================================\n";
+    cout << left << setw(22) << "Size:" << entry.fileSize - 1 << " bytes\n";
+    cout << left << setw(22) << "Stored:";
+    if (entry.isInline()) {
+        cout << "inline in its directory entry\n";
+    }
+    else if (entry.isCold()) {
+        cout << "cold tier, " << entry.coldSize << " bytes compressed\n";
+    }
+    else {
+        cout << "data region at " << entry.startAddress << "\n";
+    }
+    cout << left << setw(22) << "Created:" << formatTime(entry.createdAt) << "\n";
+    cout << left << setw(22) << "Modified:" << formatTime(entry.modifiedAt) << "\n";
+    cout << left << setw(22) << "Accessed:" << formatTime(entry.accessedAt) << " (" << entry.accessCount << " reads)\n";
+    cout << left << setw(22) << "Expires:" << (entry.expiresAt == 0 ? "never" : formatTime(entry.expiresAt)) << "\n";
+    cout << left << setw(22) << "Checksum:";
+    if (entry.checksum == 0) {
+        cout << "none\n";
+    }
+    else {
+        cout << hex << setw(8) << setfill('0') << right << entry.checksum << dec << setfill(' ') << "\n";
+    }
+    for (map<string, string>::const_iterator it = attributes.begin(); it != attributes.end(); ++it) {
+        cout << "  " << it->first << " = " << it->second << "\n";
+    }
+    cout << "===================================\n";
+    return 0;
+}
+
+// stat <name> | setattr <name> <key> <value> | rmattr <name> <key>
+template <typename Volume>
+int runAttributeCommand(Volume& fs, const vector<string>& command, OutputFormat output) {
+    if (command[0] == "stat" && command.size() == 2) {
+        return statFile(fs, command[1], output);
+    }
+    if (command[0] == "setattr" && command.size() == 4) {
+        if (!fs.setXattr(command[1], command[2], command[3])) {
+            cerr << "!!! ERROR: Couldn't set '" << command[2] << "' on '" << command[1] << "' !!!\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (command[0] == "rmattr" && command.size() == 3) {
+        if (!fs.removeXattr(command[1], command[2])) {
+            cerr << "!!! ERROR: '" << command[1] << "' has no attribute '" << command[2] << "' !!!\n";
+            return 1;
+        }
+        return 0;
+    }
+    cerr << "!!! Wrong arguments for '" << command[0] << "' !!!\n";
+    return 1;
+}
+
+// Namespaces with what they use against their quotas
+void printNamespaces(const vector<NamespaceUsage>& usage) {
+    cout << "\n=== NAMESPACES ===\n";
+    cout << "===================================\n";
+    if (usage.empty()) {
+        cout << "** No namespaces yet **\n";
+        return;
+    }
+
+    cout << left << setw(24) << "NAMESPACE" << setw(16) << "FILES" << "BYTES\n";
+    cout << "-----------------------------------\n";
+    for (int i = 0; i < (int)usage.size(); i++) {
+        string files = to_string(usage[i].files) + (usage[i].maxFiles > 0 ? "/" + to_string(usage[i].maxFiles) : "");
+        string bytes = to_string(usage[i].bytes) + (usage[i].maxBytes > 0 ? "/" + to_string(usage[i].maxBytes) : "");
+        cout << left << setw(24) << (usage[i].name.empty() ? "(none)" : usage[i].name) << setw(16) << files << bytes << "\n";
+    }
+    cout << "===================================\n";
+}
+
+// Opening a volume makes a missing image, so scrub looks first: there's
+// nothing to verify in an image that was never there
+bool imagesExist(const string& diskName, int shards) {
+    bool found = true;
+    for (int i = 0; i < max(shards, 1); i++) {
+        string path = shards > 0 ? diskName + "." + to_string(i) : diskName;
+        DiskFile image;
+        if (!image.openReadOnly(path)) {
+            cerr << "!!! ERROR: " << path << " doesn't exist, nothing to scrub !!!\n";
+            found = false;
+        }
+    }
+    return found;
+}
+
+// Verify the whole volume and say what's wrong, by file name
+template <typename Volume>
+int scrubVolume(Volume& fs, long long bytesPerSecond) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    ScrubReport report = fs.scrub(bytesPerSecond);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "\n=== SCRUB ===\n";
+    cout << left << setw(22) << "Files checked:" << report.filesChecked << " (" << report.bytesChecked / 1024 << " KB)\n";
+    cout << left << setw(22) << "Without checksums:" << report.filesUnverified << "\n";
+    cout << left << setw(22) << "Time:" << fixed << setprecision(2) << seconds << " s\n";
+    for (int i = 0; i < (int)report.problems.size(); i++) {
+        cout << "!!! CORRUPT: " << report.problems[i] << " !!!\n";
+    }
+    if (report.problems.empty()) {
+        cout << ">>> No problems found <<<\n";
+    }
+    return report.problems.empty() ? 0 : 1;
+}
+
+// Server mode: one process owns the volume and clients talk to it over a Unix
+// domain socket. Every message is a frame, a 4 byte length and then that many
+// bytes. Numbers are in host byte order, both ends are on the same machine.
+//   request:  op (1) | id (4) | name length (2) | name | data
+//   reply:    id (4) | status (1) | data
+// A client can send as many requests as it likes before reading any replies,
+// they're answered in order.
+//
+// Clients on the same machine can skip copying file bytes through the socket:
+// OP_MAP names the shared memory object holding the server's image, OP_LOOKUP
+// returns where a file sits in it plus a lease, and the client reads the bytes
+// straight out of its own mapping until it sends OP_RELEASE (or the lease runs out).
+enum ServerOp {
+    OP_CREATE = 1,      // data = the file contents
+    OP_READ = 2,        // reply data = the file contents
+    OP_DELETE = 3,
+    OP_LIST = 4,        // reply data = name, NUL, 4 byte size for every file
+    OP_SHUTDOWN = 5,
+    OP_MAP = 6,         // reply data = 4 byte mapping size, shared memory name
+    OP_LOOKUP = 7,      // reply data = address, length, lease id, lease ms (4 bytes each)
+    OP_RELEASE = 8      // data = 4 byte lease id
+};
+
+enum ServerStatus {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND = 1,
+    STATUS_FAILED = 2,        // already exists, no room, ...
+    STATUS_BAD_REQUEST = 3,
+    STATUS_NOT_SHARED = 4     // no shared memory for this one, use OP_READ
+};
+
+const char* const DEFAULT_SOCKET = "simplefs.sock";
+const int MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+struct ServerRequest {
+    int op;
+    int id;
+    string name;
+    string data;
+};
+
+void appendFrame(string& out, const string& body) {
+    int length = body.size();
+    out.append((const char*)&length, 4);
+    out += body;
+}
+
+void encodeRequest(const ServerRequest& request, string& out) {
+    string body(1, (char)request.op);
+    unsigned short nameLength = request.name.size();
+    body.append((const char*)&request.id, 4);
+    body.append((const char*)&nameLength, 2);
+    body += request.name;
+    body += request.data;
+    appendFrame(out, body);
+}
+
+bool decodeRequest(const char* body, int length, ServerRequest& request) {
+    if (length < 7) {
+        return false;
+    }
+    unsigned short nameLength;
+    request.op = (unsigned char)body[0];
+    memcpy(&request.id, body + 1, 4);
+    memcpy(&nameLength, body + 5, 2);
+    if (7 + nameLength > length) {
+        return false;
+    }
+    request.name.assign(body + 7, nameLength);
+    request.data.assign(body + 7 + nameLength, length - 7 - nameLength);
+    return true;
+}
+
+void encodeReply(int id, int status, const string& data, string& out) {
+    string body((const char*)&id, 4);
+    body += (char)status;
+    body += data;
+    appendFrame(out, body);
+}
+
+// Pull one whole frame off the front of a receive buffer, false if it isn't all there yet
+bool takeFrame(string& buffer, size_t& pos, string& body, bool& broken) {
+    if (buffer.size() - pos < 4) {
+        return false;
+    }
+    int length;
+    memcpy(&length, buffer.data() + pos, 4);
+    if (length < 0 || length > MAX_FRAME_SIZE) {
+        broken = true;
+        return false;
+    }
+    if (buffer.size() - pos - 4 < (size_t)length) {
+        return false;
+    }
+    body.assign(buffer, pos + 4, length);
+    pos += 4 + length;
+    return true;
+}
+
+#ifndef _WIN32
+bool sendAll(int fd, const string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool fillSocketAddress(const string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+    return true;
+}
+#endif
+
+#ifdef __linux__
+// Owns the socket and serves every client from a few event loop threads.
+// Sockets are non-blocking and each loop waits on its own epoll set, all of
+// them sharing the listening socket. Calls into the volume are serialized
+// with one lock, and the volume runs with deferred saves: each loop round
+// handles every request that has arrived, does one flush for all the changes,
+// and only then sends the replies. A burst of writes costs a single save, and
+// a client never hears "ok" before its change is on disk.
+template <typename Volume>
+class FileServer {
+public:
+    static const int MAX_EVENTS = 256;
+    static const int LEASE_MS = 10000;          // how long a lookup keeps a file's bytes in place
+    static const int LEASE_SWEEP_MS = 1000;     // how often expired leases are looked for
+
+    FileServer(Volume& volume, const string& path, int loops, int scrubSeconds, long long scrubBytesPerSecond) {
+        fs = &volume;
+        socketPath = path;
+        loopCount = max(loops, 1);
+        scrubEvery = scrubSeconds;
+        scrubRate = scrubBytesPerSecond;
+        listenFd = -1;
+        stopFd = -1;
+        stopping = false;
+        nextLeaseId = 1;
+    }
+
+    ~FileServer() {
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            unlink(socketPath.c_str());
+        }
+        if (stopFd >= 0) {
+            ::close(stopFd);
+        }
+    }
+
+    bool start() {
+        sockaddr_un address;
+        if (!fillSocketAddress(socketPath, address)) {
+            cerr << "!!! ERROR: Socket path '" << socketPath << "' is too long !!!\n";
+            return false;
+        }
+
+        // A socket file nobody answers on is left over from a crash, take it over
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && ::connect(probe, (sockaddr*)&address, sizeof(address)) == 0) {
+            ::close(probe);
+            cerr << "!!! ERROR: A server is already running on '" << socketPath << "' !!!\n";
+            return false;
+        }
+        if (probe >= 0) {
+            ::close(probe);
+        }
+        unlink(socketPath.c_str());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+            cerr << "!!! ERROR: Couldn't listen on '" << socketPath << "': " << strerror(errno) << " !!!\n";
+            return false;
+        }
+
+        // Never read, so once written it wakes every loop for good
+        stopFd = eventfd(0, EFD_NONBLOCK);
+        return stopFd >= 0;
+    }
+
+    // Serve until a client sends OP_SHUTDOWN
+    void run() {
+        cout << ">>> Serving on " << socketPath << " with " << loopCount << " event loops <<<\n";
+        vector<thread> loops;
+        for (int i = 1; i < loopCount; i++) {
+            loops.push_back(thread(&FileServer::eventLoop, this));
+        }
+        if (scrubEvery > 0) {
+            loops.push_back(thread(&FileServer::scrubLoop, this));
+        }
+        eventLoop();
+        for (int i = 0; i < (int)loops.size(); i++) {
+            loops[i].join();
+        }
+        cout << ">>> Server stopped <<<\n";
+    }
+
+private:
+    // A client as one loop sees it: bytes received but not parsed yet and
+    // replies not sent yet
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        bool watchingWrites;    // EPOLLOUT is on because the socket was full
+        bool closing;
+    };
+
+    // A file's bytes lent to a client, pinned in place until released or expired
+    struct Lease {
+        int address;
+        Connection* owner;
+        chrono::steady_clock::time_point expires;
+    };
+
+    Volume* fs;
+    string socketPath;
+    int loopCount;
+    int scrubEvery;             // seconds between background scrubs, 0 = never
+    long long scrubRate;        // their budget in bytes per second, 0 = none
+    int listenFd;
+    int stopFd;
+    mutex lock;                 // guards the volume and the leases
+    atomic<bool> stopping;
+    map<int, Lease> leases;
+    int nextLeaseId;
+
+    void eventLoop() {
+        int epollFd = epoll_create1(0);
+        if (epollFd < 0) {
+            cerr << "!!! ERROR: epoll_create1 failed: " << strerror(errno) << " !!!\n";
+            return;
+        }
+        watch(epollFd, listenFd, EPOLLIN | EPOLLEXCLUSIVE);
+        watch(epollFd, stopFd, EPOLLIN);
+
+        unordered_map<int, Connection*> connections;
+        epoll_event events[MAX_EVENTS];
+        while (!stopping) {
+            int count = epoll_wait(epollFd, events, MAX_EVENTS, LEASE_SWEEP_MS);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                break;
+            }
+            dropLeases(nullptr);
+            if (count == 0) {
+                expireIdle();
+            }
+            TaskPool::ForegroundScope busy;   // maintenance jobs back off meanwhile
+
+            vector<Connection*> ready;
+            bool changed = false;
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptAll(epollFd, connections);
+                    continue;
+                }
+                if (fd == stopFd) {
+                    continue;
+                }
+
+                Connection* connection = connections[fd];
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    changed |= receive(*connection);
+                }
+                ready.push_back(connection);
+            }
+
+            // One save for everything this round changed, then the replies
+            if (changed) {
+                lock_guard<mutex> guard(lock);
+                fs->flush();
+            }
+            // (a peer that hung up right after its last request still gets
+            // whatever replies its socket will take)
+            for (int i = 0; i < (int)ready.size(); i++) {
+                Connection* connection = ready[i];
+                sendPending(epollFd, *connection);
+                if (connection->closing) {
+                    dropLeases(connection);
+                    connections.erase(connection->fd);
+                    ::close(connection->fd);
+                    delete connection;
+                }
+            }
+        }
+
+        for (typename unordered_map<int, Connection*>::iterator it = connections.begin(); it != connections.end(); ++it) {
+            ::close(it->first);
+            delete it->second;
+        }
+        ::close(epollFd);
+    }
+
+    // Quiet for a while: reclaim expired files nobody has bumped into
+    void expireIdle() {
+        lock_guard<mutex> guard(lock);
+        if (fs->expireFiles() > 0) {
+            fs->flush();
+        }
+    }
+
+    // Background scrub, a batch at a time under the volume lock so clients
+    // keep getting served in between (and the pool backs off while they are)
+    void scrubLoop() {
+        while (!stopping) {
+            for (int waited = 0; waited < scrubEvery * 1000 && !stopping; waited += LEASE_SWEEP_MS) {
+                this_thread::sleep_for(chrono::milliseconds((int)LEASE_SWEEP_MS));
+            }
+            if (stopping) {
+                break;
+            }
+            ScrubReport report = fs->scrub(scrubRate, &lock, &stopping);
+            for (int i = 0; i < (int)report.problems.size(); i++) {
+                cerr << "!!! CORRUPT: " << report.problems[i] << " !!!\n";
+            }
+        }
+    }
+
+    void watch(int epollFd, int fd, unsigned int eventMask) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = eventMask;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void acceptAll(int epollFd, unordered_map<int, Connection*>& connections) {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) {
+                return;     // EAGAIN, or another loop got there first
+            }
+            Connection* connection = new Connection();
+            connection->fd = fd;
+            connection->watchingWrites = false;
+            connection->closing = false;
+            connections[fd] = connection;
+            watch(epollFd, fd, EPOLLIN);
+        }
+    }
+
+    // Read everything the socket has and answer every whole request in it.
+    // Returns true if any of them changed the volume.
+    bool receive(Connection& connection) {
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection.in.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                connection.closing = true;
+            }
+            break;
+        }
+
+        bool changed = false;
+        bool broken = false;
+        size_t pos = 0;
+        string body;
+        while (takeFrame(connection.in, pos, body, broken)) {
+            ServerRequest request;
+            if (decodeRequest(body.data(), body.size(), request)) {
+                changed |= handle(request, connection);
+            }
+            else {
+                encodeReply(0, STATUS_BAD_REQUEST, "", connection.out);
+            }
+        }
+        connection.in.erase(0, pos);
+
+        if (broken) {
+            connection.closing = true;
+        }
+        return changed;
+    }
+
+    // Write as much as the socket takes, and ask to hear when it has room for the rest
+    void sendPending(int epollFd, Connection& connection) {
+        size_t done = 0;
+        while (done < connection.out.size()) {
+            ssize_t n = send(connection.fd, connection.out.data() + done, connection.out.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                connection.closing = true;
+                return;
+            }
+            done += n;
+        }
+        connection.out.erase(0, done);
+
+        bool wantWrites = !connection.out.empty();
+        if (wantWrites != connection.watchingWrites) {
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = wantWrites ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            event.data.fd = connection.fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+            connection.watchingWrites = wantWrites;
+        }
+    }
+
+    // Unpin the leases a closing connection still holds, or with no owner
+    // given, every lease that has run out
+    void dropLeases(Connection* owner) {
+        lock_guard<mutex> guard(lock);
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        for (typename map<int, Lease>::iterator it = leases.begin(); it != leases.end();) {
+            if (owner != nullptr ? it->second.owner == owner : it->second.expires <= now) {
+                fs->unpinFile(it->second.address);
+                leases.erase(it++);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    // Returns true if the request changed the volume
+    bool handle(const ServerRequest& request, Connection& connection) {
+        lock_guard<mutex> guard(lock);
+        string data;
+        int status = STATUS_OK;
+
+        switch (request.op) {
+        case OP_CREATE:
+            status = fs->createNewFile(request.name, request.data) ? STATUS_OK : STATUS_FAILED;
+            break;
+
+        case OP_READ: {
+            int fileHandle = fs->openFile(request.name);
+            if (fileHandle < 0) {
+                status = STATUS_NOT_FOUND;
+                break;
+            }
+            char chunk[64 * 1024];
+            int n;
+            while ((n = fs->readFile(fileHandle, data.size(), chunk, sizeof(chunk))) > 0) {
+                data.append(chunk, n);
+            }
+            fs->closeFile(fileHandle);
+            break;
+        }
+
+        case OP_DELETE:
+            status = fs->deleteFile(request.name) ? STATUS_OK : STATUS_NOT_FOUND;
+            break;
+
+        case OP_LIST: {
+            vector<FileEntry> entries;
+            fs->collectEntries(entries);
+            for (int i = 0; i < (int)entries.size(); i++) {
+                data.append(entries[i].fileName, strlen(entries[i].fileName) + 1);
+                data.append((const char*)&entries[i].fileSize, 4);
+            }
+            break;
+        }
+
+        case OP_MAP: {
+            string name = fs->getShareName();
+            if (name.empty()) {
+                status = STATUS_NOT_SHARED;
+                break;
+            }
+            int size = fs->getSharedSize();
+            data.append((const char*)&size, 4);
+            data += name;
+            break;
+        }
+
+        case OP_LOOKUP: {
+            Lease lease;
+            int length;
+            if (!fs->pinFile(request.name, lease.address, length)) {
+                status = STATUS_NOT_SHARED;
+                break;
+            }
+            lease.owner = &connection;
+            lease.expires = chrono::steady_clock::now() + chrono::milliseconds((int)LEASE_MS);
+            int leaseId = nextLeaseId++;
+            int leaseMs = LEASE_MS;
+            leases[leaseId] = lease;
+
+            data.append((const char*)&lease.address, 4);
+            data.append((const char*)&length, 4);
+            data.append((const char*)&leaseId, 4);
+            data.append((const char*)&leaseMs, 4);
+            break;
+        }
+
+        case OP_RELEASE: {
+            int leaseId = 0;
+            typename map<int, Lease>::iterator lease = leases.end();
+            if (request.data.size() == 4) {
+                memcpy(&leaseId, request.data.data(), 4);
+                lease = leases.find(leaseId);
+            }
+            if (lease == leases.end() || lease->second.owner != &connection) {
+                status = STATUS_NOT_FOUND;
+                break;
+            }
+            fs->unpinFile(lease->second.address);
+            leases.erase(lease);
+            break;
+        }
+
+        case OP_SHUTDOWN: {
+            stopping = true;
+            uint64_t one = 1;
+            if (write(stopFd, &one, sizeof(one)) < 0) {
+                cerr << "!!! ERROR: Couldn't wake the event loops !!!\n";
+            }
+            break;
+        }
+
+        default:
+            status = STATUS_BAD_REQUEST;
+        }
+
+        encodeReply(request.id, status, data, connection.out);
+        return status == STATUS_OK && (request.op == OP_CREATE || request.op == OP_DELETE);
+    }
+};
+#endif
+
+#ifndef _WIN32
+
+// Client side. Requests pile up in a buffer until flush(), so a batch of
+// them goes out in one write and the server can work through it in one go.
+class FileClient {
+public:
+    FileClient() {
+        fd = -1;
+        nextId = 1;
+        shared = nullptr;
+        sharedSize = 0;
+    }
+
+    ~FileClient() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (shared != nullptr) {
+            munmap((void*)shared, sharedSize);
+        }
+    }
+
+    bool connect(const string& path) {
+        sockaddr_un address;
+        if (!fillSocketAddress(path, address)) {
+            return false;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        return fd >= 0 && ::connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+    }
+
+    // Queue a request, returns the id its reply will carry
+    int send(int op, const string& name, const string& data = "") {
+        ServerRequest request;
+        request.op = op;
+        request.id = nextId++;
+        request.name = name;
+        request.data = data;
+        encodeRequest(request, out);
+        return request.id;
+    }
+
+    bool flush() {
+        bool sent = sendAll(fd, out);
+        out.clear();
+        return sent;
+    }
+
+    // Wait for the next reply
+    bool receive(int& id, int& status, string& data) {
+        string body;
+        bool broken = false;
+        size_t pos = 0;
+        vector<char> buffer(64 * 1024);
+        while (!takeFrame(in, pos, body, broken)) {
+            if (broken) {
+                return false;
+            }
+            ssize_t n = recv(fd, buffer.data(), buffer.size(), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            in.append(buffer.data(), n);
+        }
+        in.erase(0, pos);
+
+        if (body.size() < 5) {
+            return false;
+        }
+        memcpy(&id, body.data(), 4);
+        status = (unsigned char)body[4];
+        data.assign(body, 5, string::npos);
+        return true;
+    }
+
+    // Map the server's image read-only. False if the server doesn't share it,
+    // then everything has to come through OP_READ.
+    bool mapShared() {
+        send(OP_MAP, "");
+        int id;
+        int status;
+        string data;
+        if (!flush() || !receive(id, status, data) || status != STATUS_OK || data.size() <= 4) {
+            return false;
+        }
+
+        int size;
+        memcpy(&size, data.data(), 4);
+        int memoryFd = shm_open(data.c_str() + 4, O_RDONLY, 0);
+        if (memoryFd < 0) {
+            return false;
+        }
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, memoryFd, 0);
+        ::close(memoryFd);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        shared = (const char*)mapping;
+        sharedSize = size;
+        return true;
+    }
+
+    // The server's image, nullptr unless mapShared() worked
+    const char* sharedBytes() const {
+        return shared;
+    }
+
+    int getSharedSize() const {
+        return sharedSize;
+    }
+
+private:
+    int fd;
+    int nextId;
+    string out;     // requests not sent yet
+    string in;      // reply bytes not consumed yet
+    const char* shared;
+    int sharedSize;
+};
+
+// cat through shared memory: look every file up, write its bytes to stdout
+// straight from the mapping, then hand the leases back. Files the server
+// can't lend out (inline, cold, ...) come through OP_READ as usual.
+int catShared(FileClient& client, const vector<string>& names) {
+    struct Result {
+        int status;
+        int address;
+        int length;
+        int leaseId;        // 0 = no lease, the bytes are in data
+        string data;
+    };
+    vector<Result> results(names.size());
+
+    for (int i = 0; i < (int)names.size(); i++) {
+        client.send(OP_LOOKUP, names[i]);
+    }
+    bool connected = client.flush();
+
+    vector<int> fallback;
+    for (int i = 0; connected && i < (int)names.size(); i++) {
+        int id;
+        string data;
+        Result& result = results[i];
+        result.leaseId = 0;
+        connected = client.receive(id, result.status, data);
+        if (result.status == STATUS_OK && data.size() == 16) {
+            memcpy(&result.address, data.data(), 4);
+            memcpy(&result.length, data.data() + 4, 4);
+            memcpy(&result.leaseId, data.data() + 8, 4);
+        }
+        else {
+            client.send(OP_READ, names[i]);
+            fallback.push_back(i);
+        }
+    }
+    connected = connected && client.flush();
+    for (int i = 0; connected && i < (int)fallback.size(); i++) {
+        int id;
+        connected = client.receive(id, results[fallback[i]].status, results[fallback[i]].data);
+    }
+    if (!connected) {
+        cerr << "!!! ERROR: Lost the connection to the server !!!\n";
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 0; i < (int)names.size(); i++) {
+        const Result& result = results[i];
+        if (result.leaseId != 0 && result.address >= 0 && result.address + result.length <= client.getSharedSize()) {
+            cout.write(client.sharedBytes() + result.address, result.length);
+        }
+        else if (result.leaseId == 0 && result.status == STATUS_OK) {
+            cout.write(result.data.data(), result.data.size());
+        }
+        else {
+            cerr << "!!! ERROR: '" << names[i] << "' not found !!!\n";
+            failures++;
+        }
+    }
+    cout.flush();
+
+    // Done with the bytes, let the server reuse that space again
+    int released = 0;
+    for (int i = 0; i < (int)names.size(); i++) {
+        if (results[i].leaseId != 0) {
+            client.send(OP_RELEASE, "", string((const char*)&results[i].leaseId, 4));
+            released++;
+        }
+    }
+    if (released > 0 && client.flush()) {
+        for (int i = 0; i < released; i++) {
+            int id;
+            int status;
+            string data;
+            if (!client.receive(id, status, data)) {
+                break;
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// Run one command against a server. Commands with several names send all
+// their requests before waiting for the first reply.
+int runClient(const string& socketPath, const vector<string>& command) {
+    FileClient client;
+    if (!client.connect(socketPath)) {
+        cerr << "!!! ERROR: No server on '" << socketPath << "' !!!\n";
+        return 1;
+    }
+
+    const string& verb = command[0];
+    vector<string> names(command.begin() + 1, command.end());
+    if (verb == "cat" && !names.empty() && client.mapShared()) {
+        return catShared(client, names);
+    }
+    if (verb == "cat" && !names.empty()) {
+        for (int i = 0; i < (int)names.size(); i++) {
+            client.send(OP_READ, names[i]);
+        }
+    }
+    else if (verb == "rm" && !names.empty()) {
+        for (int i = 0; i < (int)names.size(); i++) {
+            client.send(OP_DELETE, names[i]);
+        }
+    }
+    else if (verb == "put" && names.size() == 1) {
+        string data((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+        client.send(OP_CREATE, names[0], data);
+    }
+    else if (verb == "ls" && names.empty()) {
+        client.send(OP_LIST, "");
+    }
+    else if (verb == "stop" && names.empty()) {
+        client.send(OP_SHUTDOWN, "");
+    }
+    else {
+        cerr << "!!! Unknown client command '" << verb << "' !!!\n";
+        return 1;
+    }
+
+    if (!client.flush()) {
+        cerr << "!!! ERROR: Lost the connection to the server !!!\n";
+        return 1;
+    }
+
+    int failures = 0;
+    int replies = max((int)names.size(), 1);
+    for (int i = 0; i < replies; i++) {
+        int id;
+        int status;
+        string data;
+        if (!client.receive(id, status, data)) {
+            cerr << "!!! ERROR: Lost the connection to the server !!!\n";
+            return 1;
+        }
+
+        if (status != STATUS_OK) {
+            const string& name = names.empty() ? verb : names[i];
+            cerr << "!!! ERROR: '" << name << "' " << (status == STATUS_NOT_FOUND ? "not found" : "failed") << " !!!\n";
+            failures++;
+        }
+        else if (verb == "cat") {
+            cout.write(data.data(), data.size());
+        }
+        else if (verb == "ls") {
+            size_t pos = 0;
+            while (pos < data.size()) {
+                string name(data.c_str() + pos);
+                int size;
+                memcpy(&size, data.data() + pos + name.size() + 1, 4);
+                cout << left << setw(40) << name << size << " bytes\n";
+                pos += name.size() + 5;
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+int runClient(const string&, const vector<string>&) {
+    cerr << "!!! Client/server mode needs Unix domain sockets !!!\n";
+    return 1;
+}
+#endif
+
+#ifdef __linux__
+template <typename Volume>
+int runServer(Volume& fs, const string& socketPath, int loops, int scrubEvery, long long scrubRate) {
+    FileServer<Volume> server(fs, socketPath, loops, scrubEvery, scrubRate);
+    if (!server.start()) {
+        return 1;
+    }
+    server.run();
+    return 0;
+}
+#else
+template <typename Volume>
+int runServer(Volume&, const string&, int, int, long long) {
+    cerr << "!!! The server uses epoll, it only runs on Linux !!!\n";
+    return 1;
+}
+#endif
+
+#ifdef __cpp_impl_coroutine
+// Coroutine front-end: co_await afs.read(name), afs.create(name, data), ...
+// Each operation goes on a queue served by a few worker threads and the
+// coroutine is resumed on the worker once it's done. A suspended coroutine
+// holds no thread, so thousands of operations can be in flight while only
+// the pool ever blocks on the volume. A FileSystem isn't thread safe, so its
+// calls go one at a time; a ShardedFileSystem locks just the shard a call
+// lands on, so calls for different shards run side by side.
+template <typename Volume>
+struct LocksPerShard {
+    static const bool value = false;
+};
+
+template <>
+struct LocksPerShard<ShardedFileSystem> {
+    static const bool value = true;
+};
+
+template <typename Volume>
+class AsyncFileSystem {
+public:
+    typedef FileContents ReadResult;
+
+    // Awaitable returned by every operation, runs its work on the pool
+    template <typename Result>
+    class Operation {
+    public:
+        Operation(AsyncFileSystem* owner, function<Result()> job) {
+            pool = owner;
+            work = job;
+        }
+
+        bool await_ready() const {
+            return false;
+        }
+
+        void await_suspend(coroutine_handle<> waiter) {
+            pool->post([this, waiter]() {
+                result = work();
+                waiter.resume();
+            });
+        }
+
+        Result await_resume() {
+            return move(result);
+        }
+
+    private:
+        AsyncFileSystem* pool;
+        function<Result()> work;
+        Result result;
+    };
+
+    AsyncFileSystem(Volume& volume, int threadCount) {
+        fs = &volume;
+        stopping = false;
+        for (int i = 0; i < max(threadCount, 1); i++) {
+            workers.push_back(thread(&AsyncFileSystem::workerLoop, this));
+        }
+    }
+
+    // Finishes whatever is still queued first
+    ~AsyncFileSystem() {
+        {
+            lock_guard<mutex> guard(queueLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int i = 0; i < (int)workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    Operation<bool> create(const string& name, const string& data) {
+        return Operation<bool>(this, [this, name, data]() {
+            unique_lock<mutex> guard = lockVolume();
+            return fs->createNewFile(name, data);
+        });
+    }
+
+    Operation<ReadResult> read(const string& name) {
+        return Operation<ReadResult>(this, [this, name]() {
+            // One call, so a sharded volume holds the shard lock only once
+            unique_lock<mutex> guard = lockVolume();
+            return fs->readFiles(vector<string>(1, name))[0];
+        });
+    }
+
+    Operation<bool> remove(const string& name) {
+        return Operation<bool>(this, [this, name]() {
+            unique_lock<mutex> guard = lockVolume();
+            return fs->deleteFile(name);
+        });
+    }
+
+    Operation<vector<FileEntry> > list() {
+        return Operation<vector<FileEntry> >(this, [this]() {
+            unique_lock<mutex> guard = lockVolume();
+            vector<FileEntry> entries;
+            fs->collectEntries(entries);
+            return entries;
+        });
+    }
+
+private:
+    Volume* fs;
+    mutex volumeLock;               // one call at a time, unless the volume locks per shard
+    mutex queueLock;
+    condition_variable wake;
+    deque<function<void()> > queue;
+    vector<thread> workers;
+    bool stopping;
+
+    unique_lock<mutex> lockVolume() {
+        if (LocksPerShard<Volume>::value) {
+            return unique_lock<mutex>();
+        }
+        return unique_lock<mutex>(volumeLock);
+    }
+
+    void post(function<void()> job) {
+        {
+            lock_guard<mutex> guard(queueLock);
+            queue.push_back(move(job));
+        }
+        wake.notify_one();
+    }
+
+    void workerLoop() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> guard(queueLock);
+                wake.wait(guard, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                job = move(queue.front());
+                queue.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// Coroutine that starts right away and cleans up after itself, for callers
+// that don't bring their own task type
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() {
+            return DetachedTask();
+        }
+        suspend_never initial_suspend() {
+            return suspend_never();
+        }
+        suspend_never final_suspend() noexcept {
+            return suspend_never();
+        }
+        void return_void() {
+        }
+        void unhandled_exception() {
+            terminate();
+        }
+    };
+};
+
+// One simulated client: a few reads of random files, counted when done
+template <typename Volume>
+DetachedTask asyncReader(AsyncFileSystem<Volume>& afs, int fileCount, int reads, unsigned int seed,
+                         atomic<int>& hits, atomic<int>& remaining) {
+    mt19937 random(seed);
+    for (int i = 0; i < reads; i++) {
+        typename AsyncFileSystem<Volume>::ReadResult result = co_await afs.read("file" + to_string(random() % fileCount));
+        if (result.found) {
+            hits++;
+        }
+    }
+    remaining--;
+}
+
+// Fill a volume, then launch thousands of coroutines reading it on a few threads
+template <typename Volume>
+void benchAsyncReads(Volume& fs, const string& label) {
+    const int FILES = 50;
+    const int READERS = 5000;
+    const int READS_EACH = 4;
+    const int THREADS = 4;
+
+    for (int i = 0; i < FILES; i++) {
+        fs.createNewFile("file" + to_string(i), string(4096 + i * 100, 'a' + i % 26));
+    }
+
+    atomic<int> hits(0);
+    atomic<int> remaining(READERS);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    {
+        AsyncFileSystem<Volume> afs(fs, THREADS);
+        for (int i = 0; i < READERS; i++) {
+            asyncReader(afs, FILES, READS_EACH, i, hits, remaining);
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "--- " << label << " ---\n";
+    cout << left << setw(22) << "Coroutines:" << READERS << " on " << THREADS << " threads\n";
+    cout << left << setw(22) << "Reads:" << hits << "/" << READERS * READS_EACH << " found\n";
+    cout << left << setw(22) << "Unfinished:" << remaining << "\n";
+    cout << left << setw(22) << "Throughput:" << fixed << setprecision(0) << READERS * READS_EACH / seconds << " reads/s\n";
+    cout.unsetf(ios::fixed);
+}
+
+// The same reads against one scratch volume (calls one at a time) and a
+// sharded one (one lock per shard)
+void runAsyncBenchmark() {
+    const int SHARDS = 4;
+    const string imageName = "asyncbench.bin";
+
+    FileSystemOptions options;
+    options.quiet = true;
+    options.format = true;
+    cout << "\n=== ASYNC BENCHMARK ===\n";
+    cout << "===================================\n";
+    {
+        FileSystem fs(imageName, options);
+        benchAsyncReads(fs, "1 volume");
+    }
+    {
+        ShardedFileSystem fs(imageName, SHARDS, options);
+        benchAsyncReads(fs, to_string(SHARDS) + " shards");
+    }
+    cout << "===================================\n";
+    remove(imageName.c_str());
+    for (int i = 0; i < SHARDS; i++) {
+        remove((imageName + "." + to_string(i)).c_str());
+    }
+}
+#else
+void runAsyncBenchmark() {
+    cerr << "!!! The coroutine API needs a C++20 compiler (-std=c++20) !!!\n";
+}
+#endif
+
+// selftest: quick checks of what's easy to break without noticing, on
+// scratch images that are removed again. Old image formats must load and
+// come back as version 2, a damaged allocator table must never lead to space
+// a file is using being handed out, and archives must round-trip and refuse
+// damage.
+
+// Timestamps and expiry of the files in a version 1 test image
+const unsigned int LEGACY_CREATED = 1500000000;
+const long long LEGACY_EXPIRES = 4000000000LL;
+
+// An image of the given files as a version 0 or 1 build wrote it
+bool writeLegacyImage(const string& imageName, int version, const vector<pair<string, string> >& files) {
+    const int IMAGE_SIZE = 10 * 1024 * 1024;
+    const int DATA_START = 1024 * 1024;
+    const int V1_ENTRY_SIZE = 216;      // sizeof(FileEntry) in a 64-bit build
+
+    vector<char> image(IMAGE_SIZE, 0);
+    int entryOffset = version == 0 ? 8 : 16;
+    int entrySize = version == 0 ? 108 : V1_ENTRY_SIZE;
+    int address = DATA_START;
+    for (int i = 0; i < (int)files.size(); i++) {
+        char* entry = &image[entryOffset + i * entrySize];
+        const string& data = files[i].second;
+        int size = data.size() + 1;
+        memcpy(entry, files[i].first.c_str(), files[i].first.size());
+        putLE32(entry + 100, address);
+        putLE32(entry + 104, size);
+        if (version == 1) {
+            putLE32(entry + 184, checksumOf(data.c_str(), size));
+            putLE64(entry + 192, LEGACY_EXPIRES);
+            putLE32(entry + 200, LEGACY_CREATED);
+            putLE32(entry + 204, LEGACY_CREATED);
+        }
+        memcpy(&image[address], data.c_str(), size);
+        address += size;
+    }
+    if (version == 0) {
+        putLE32(&image[0], files.size());
+        putLE32(&image[4], address);
+    }
+    else {
+        putLE32(&image[0], 0x31534653);     // "SFS1"
+        putLE32(&image[4], files.size());
+        putLE32(&image[8], address);
+        putLE32(&image[12], entrySize);
+    }
+
+    ofstream out(imageName.c_str(), ios::binary);
+    out.write(image.data(), image.size());
+    return (bool)out;
+}
+
+bool readsBack(FileSystem& fs, const vector<pair<string, string> >& files) {
+    vector<string> names;
+    for (int i = 0; i < (int)files.size(); i++) {
+        names.push_back(files[i].first);
+    }
+    vector<FileContents> got = fs.readFiles(names);
+    for (int i = 0; i < (int)files.size(); i++) {
+        if (!got[i].found || got[i].data != files[i].second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Load an old image, change it so it gets saved, then check the save is
+// version 2 and still holds everything
+bool checkLegacyUpgrade(int version) {
+    const string imageName = "selftest.bin";
+    vector<pair<string, string> > files;
+    files.push_back(make_pair("notes.txt", string(300, 'n')));
+    string big;
+    for (int i = 0; big.size() < 20000; i++) {
+        big += to_string(i) + " ";
+    }
+    files.push_back(make_pair("big.txt", big));
+    if (!writeLegacyImage(imageName, version, files)) {
+        return false;
+    }
+
+    FileSystemOptions options;
+    options.quiet = true;
+    bool ok;
+    {
+        FileSystem fs(imageName, options);
+        ok = readsBack(fs, files) && fs.createNewFile("new.txt", "written after the upgrade");
+        // Version 1 entries carry timestamps and an expiry, past some padding
+        vector<ArchivedFile> entries = fs.exportFiles();
+        for (int i = 0; i < (int)entries.size() && version == 1; i++) {
+            if (entries[i].name != "new.txt" && (entries[i].createdAt != LEGACY_CREATED || entries[i].expiresAt != LEGACY_EXPIRES)) {
+                ok = false;
+            }
+        }
+    }
+    files.push_back(make_pair("new.txt", "written after the upgrade"));
+
+    char magic[4] = {};
+    ifstream in(imageName.c_str(), ios::binary);
+    in.read(magic, 4);
+    in.close();
+    ok = ok && getLE32(magic) == 0x474D4953;   // "SIMG"
+    {
+        FileSystem fs(imageName, options);
+        ok = ok && readsBack(fs, files) && fs.scrub(0).problems.empty();
+    }
+    remove(imageName.c_str());
+    return ok;
+}
+
+// Hand out space until there's none left. False if any of it lands on
+// something in 'used' (start -> end) or outside the region.
+bool allocationsStayClear(DataAllocator* allocator, map<int, int> used, int regionStart, int regionEnd) {
+    const int SIZES[] = { 4096, 128 };
+    for (int s = 0; s < 2; s++) {
+        int address;
+        while ((address = allocator->allocate(SIZES[s])) >= 0) {
+            int end = address + SIZES[s];
+            map<int, int>::iterator next = used.upper_bound(address);
+            if (address < regionStart || end > regionEnd || (next != used.end() && next->first < end)) {
+                return false;
+            }
+            if (next != used.begin() && (--next)->second > address) {
+                return false;
+            }
+            used[address] = end;
+        }
+    }
+    return true;
+}
+
+// Fill an allocator, save its table and load it back, whole and damaged in a
+// few ways. Whatever it makes of a damaged table, no file may be given away.
+bool checkAllocatorTable(AllocPolicy policy) {
+    const int REGION_START = 1024 * 1024;
+    const int REGION_END = 10 * 1024 * 1024;
+    const int AREA_SIZE = 512 * 1024 - 4096;   // what the image has for the table
+    const int DAMAGES = 6;
+
+    DataAllocator* allocator = createAllocator(policy, REGION_START, REGION_END);
+    mt19937 rng(42);
+    vector<pair<int, int> > files;
+    vector<char> stale(AREA_SIZE, 0);
+    for (int i = 0; i < 600; i++) {
+        // A table from earlier on, as if the image went down between saving
+        // the directory and saving the table
+        if (i == 400) {
+            allocator->save(stale.data());
+        }
+        int size = i % 4 == 0 ? 8192 + rng() % 60000 : 65 + rng() % 4000;
+        int address = allocator->allocate(size);
+        if (address < 0) {
+            continue;
+        }
+        // Every third goes again, so the table has holes and half full slabs
+        if (i % 3 == 0) {
+            allocator->release(address, size);
+        }
+        else {
+            files.push_back(make_pair(address, size));
+        }
+    }
+    vector<char> area(AREA_SIZE, 0);
+    allocator->save(area.data());
+    int savedSize = allocator->savedSize();
+    int freeBytes = allocator->freeBytes();
+    int highWater = allocator->getHighWater();
+    delete allocator;
+
+    map<int, int> used;
+    for (int i = 0; i < (int)files.size(); i++) {
+        used[files[i].first] = files[i].first + files[i].second;
+    }
+
+    bool ok = true;
+    for (int damage = 0; damage < DAMAGES && ok; damage++) {
+        vector<char> table = area;
+        int tableSize = AREA_SIZE;
+        if (damage == 1) {
+            tableSize = savedSize - 1;      // cut short
+        }
+        else if (damage == 2) {
+            table = stale;
+        }
+        else if (damage == 3) {
+            // A small number where the first slab's size class or the first
+            // buddy free block is
+            putLE32(&table[8], (getLE32(&table[8]) + 1) % NUM_SIZE_CLASSES);
+        }
+        else if (damage == 4) {
+            for (int i = 4; i < savedSize; i++) {
+                table[i] = (char)rng();
+            }
+        }
+        else if (damage == 5) {
+            fill(table.begin(), table.end(), (char)0xff);
+        }
+
+        allocator = createAllocator(policy, REGION_START, REGION_END);
+        allocator->load(table.data(), tableSize, files, highWater);
+        // The whole table has to come back exactly as it was
+        if (damage == 0 && allocator->freeBytes() != freeBytes) {
+            ok = false;
+        }
+        ok = ok && allocationsStayClear(allocator, used, REGION_START, REGION_END);
+        delete allocator;
+    }
+    return ok;
+}
+
+bool sameArchivedFiles(vector<ArchivedFile> a, vector<ArchivedFile> b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    sort(a.begin(), a.end(), [](const ArchivedFile& x, const ArchivedFile& y) { return x.name < y.name; });
+    sort(b.begin(), b.end(), [](const ArchivedFile& x, const ArchivedFile& y) { return x.name < y.name; });
+    for (int i = 0; i < (int)a.size(); i++) {
+        if (a[i].name != b[i].name || a[i].data != b[i].data || a[i].expiresAt != b[i].expiresAt
+            || a[i].createdAt != b[i].createdAt || a[i].modifiedAt != b[i].modifiedAt
+            || a[i].attributes != b[i].attributes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Export a volume into an archive in memory and import it into a fresh one,
+// then the same archive with a flipped byte or cut short must be refused
+bool checkArchiveRoundTrip() {
+    const string sourceName = "selftest.bin";
+    const string targetName = "selftest2.bin";
+
+    FileSystemOptions options;
+    options.quiet = true;
+    options.format = true;
+    vector<ArchivedFile> exported;
+    {
+        FileSystem fs(sourceName, options);
+        string blob;
+        for (int i = 0; blob.size() < 100000; i++) {
+            blob += to_string(i * 7) + ",";
+        }
+        fs.createNewFile("tiny", "inline");
+        fs.createNewFile("docs/readme", string(5000, 'r'));
+        fs.createNewFile("blob", blob);
+        fs.setXattr("blob", "owner", "selftest");
+        exported = fs.exportFiles();
+    }
+
+    ostringstream archive;
+    bool ok = exported.size() == 3 && writeArchive(exported, archive);
+    string error;
+    vector<ArchivedFile> imported;
+    istringstream whole(archive.str());
+    ok = ok && readArchive(whole, imported, error);
+    {
+        FileSystem fs(targetName, options);
+        vector<bool> done = fs.importFiles(imported);
+        ok = ok && count(done.begin(), done.end(), false) == 0 && sameArchivedFiles(exported, fs.exportFiles());
+    }
+
+    string damaged = archive.str();
+    damaged[damaged.size() / 2] ^= 1;
+    istringstream flipped(damaged);
+    istringstream cut(archive.str().substr(0, archive.str().size() - 10));
+    vector<ArchivedFile> ignored;
+    ok = ok && !readArchive(flipped, ignored, error) && !readArchive(cut, ignored, error);
+
+    remove(sourceName.c_str());
+    remove(targetName.c_str());
+    return ok;
+}
+
+int reportCheck(const string& name, bool passed) {
+    cout << left << setw(44) << name << (passed ? "ok" : "FAILED") << "\n";
+    return passed ? 0 : 1;
+}
+
+int runSelfTest() {
+    cout << "\n=== SELF TEST ===\n";
+    cout << "===================================\n";
+    int failed = 0;
+    failed += reportCheck("Version 0 image upgrades to 2", checkLegacyUpgrade(0));
+    failed += reportCheck("Version 1 image upgrades to 2", checkLegacyUpgrade(1));
+    failed += reportCheck("Slab table, whole and damaged", checkAllocatorTable(ALLOC_SLAB));
+    failed += reportCheck("Buddy table, whole and damaged", checkAllocatorTable(ALLOC_BUDDY));
+    failed += reportCheck("Archive round trip, damage refused", checkArchiveRoundTrip());
+    cout << "===================================\n";
+    if (failed > 0) {
+        cout << "!!! " << failed << " check(s) failed !!!\n";
+        return 1;
+    }
+    cout << ">>> All checks passed <<<\n";
+    return 0;
+}
+
+void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [options]                 interactive menu\n";
+    cerr << "       " << program << " [options] list            the file table (see --limit, --offset)\n";
+    cerr << "       " << program << " [options] stats           usage, tiering and cache numbers\n";
+    cerr << "       " << program << " [options] cat <name>      write a file to stdout\n";
+    cerr << "       " << program << " [options] add <path>...   copy local files in with a single save\n";
+    cerr << "       " << program << " [options] search <text>   names of the files containing text\n";
+    cerr << "       " << program << " [options] export <archive> | import <archive>  live files only, - for stdout/stdin\n";
+    cerr << "       " << program << " [options] scrub           verify every file and the metadata\n";
+    cerr << "       " << program << " [options] stat <name>     timestamps, attributes and where a file lives\n";
+    cerr << "       " << program << " [options] setattr <name> <key> <value> | rmattr <name> <key>\n";
+    cerr << "       " << program << " [options] quota <ns> <files> <MB>  limit namespace ns (0 = no limit)\n";
+    cerr << "       " << program << " [options] quotas          namespace usage and limits\n";
+    cerr << "       " << program << " [options] format          wipe the image and start empty\n";
+    cerr << "       " << program << " [options] serve [SOCKET]  own the image and serve clients\n";
+    cerr << "       " << program << " --connect=SOCKET cat|rm <name>... | put <name> | ls | stop\n";
+    cerr << "       " << program << " bench-cache               compare LRU and 2Q hit rates\n";
+    cerr << "       " << program << " bench-alloc               compare slab and buddy allocators\n";
+    cerr << "       " << program << " bench-async               coroutine reads on a small thread pool\n";
+    cerr << "       " << program << " selftest                  check old formats, allocator tables and archives\n";
+    cerr << "Options:\n";
+    cerr << "  --disk=FILE              disk image to use (default simpledisk.bin)\n";
+    cerr << "  --cache-blocks=N         keep only N 4KB data blocks in memory\n";
+    cerr << "  --cache-policy=lru|2q    eviction policy for the block cache\n";
+    cerr << "  --alloc=slab|buddy       data allocator for a new or formatted image\n";
+    cerr << "  --shards=N               spread files over N volumes FILE.0 .. FILE.N-1\n";
+    cerr << "  --stripe=F1,F2,...       keep a new image's data striped over these files\n";
+    cerr << "  --stripe-unit=KB         stripe unit, a multiple of 4 (default 64)\n";
+    cerr << "  --server-loops=N         event loop threads for serve (default 2)\n";
+    cerr << "  --tiering                move rarely read files to a compressed FILE.cold\n";
+    cerr << "  --shared                 lock the image so several processes can use it at once\n";
+    cerr << "  --read-only              map the image for reading, never change or save it\n";
+    cerr << "  --ttl=SEC                add: the files delete themselves after SEC seconds\n";
+    cerr << "  --output=text|json|binary  list, stat, stats: tables, JSON lines or binary records\n";
+    cerr << "  --limit=N                list: show at most N files\n";
+    cerr << "  --offset=N               list: skip the first N files (the next page)\n";
+    cerr << "  --scrub-rate=MB          keep a scrub under MB per second (default flat out)\n";
+    cerr << "  --scrub-every=SEC        serve: scrub in the background every SEC seconds\n";
+}
+
+int main(int argc, char* argv[]) {
+    FileSystemOptions options;
+    string diskName = "simpledisk.bin";
+    int shards = 0;
+    string connectTo;
+    int serverLoops = 2;
+    long long scrubRate = 0;
+    int scrubEvery = 0;
+    int ttlSeconds = 0;
+    int listOffset = 0;
+    int listLimit = 0;
+    OutputFormat output = OUTPUT_TEXT;
+    vector<string> command;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (!command.empty() || arg[0] != '-') {
+            command.push_back(arg);
+        }
+        else if (arg.compare(0, 7, "--disk=") == 0) {
+            diskName = arg.substr(7);
+        }
+        else if (arg.compare(0, 15, "--cache-blocks=") == 0) {
+            options.cacheBlocks = atoi(arg.c_str() + 15);
+        }
+        else if (arg == "--cache-policy=lru") {
+            options.cachePolicy = POLICY_LRU;
+        }
+        else if (arg == "--cache-policy=2q") {
+            options.cachePolicy = POLICY_2Q;
+        }
+        else if (arg == "--alloc=slab") {
+            options.allocPolicy = ALLOC_SLAB;
+        }
+        else if (arg == "--alloc=buddy") {
+            options.allocPolicy = ALLOC_BUDDY;
+        }
+        else if (arg.compare(0, 9, "--shards=") == 0) {
+            shards = atoi(arg.c_str() + 9);
+        }
+        else if (arg.compare(0, 9, "--stripe=") == 0) {
+            string list = arg.substr(9);
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                if (comma == string::npos) {
+                    comma = list.size();
+                }
+                if (comma > start) {
+                    options.stripePaths.push_back(list.substr(start, comma - start));
+                }
+                start = comma + 1;
+            }
+        }
+        else if (arg.compare(0, 10, "--connect=") == 0) {
+            connectTo = arg.substr(10);
+        }
+        else if (arg.compare(0, 15, "--server-loops=") == 0) {
+            serverLoops = atoi(arg.c_str() + 15);
+        }
+        else if (arg == "--tiering") {
+            options.tiering = true;
+        }
+        else if (arg == "--shared") {
+#ifdef _WIN32
+            cerr << "!!! --shared needs fcntl locks, it isn't available on Windows !!!\n";
+            return 1;
+#endif
+            options.sharedAccess = true;
+        }
+        else if (arg == "--read-only") {
+            options.readOnly = true;
+        }
+        else if (arg.compare(0, 6, "--ttl=") == 0) {
+            ttlSeconds = atoi(arg.c_str() + 6);
+        }
+        else if (arg == "--output=text") {
+            output = OUTPUT_TEXT;
+        }
+        else if (arg == "--output=json") {
+            output = OUTPUT_JSON;
+        }
+        else if (arg == "--output=binary") {
+            output = OUTPUT_BINARY;
+        }
+        else if (arg.compare(0, 8, "--limit=") == 0) {
+            listLimit = atoi(arg.c_str() + 8);
+        }
+        else if (arg.compare(0, 9, "--offset=") == 0) {
+            listOffset = atoi(arg.c_str() + 9);
+        }
+        else if (arg.compare(0, 13, "--scrub-rate=") == 0) {
+            scrubRate = atoll(arg.c_str() + 13) * 1024 * 1024;
+        }
+        else if (arg.compare(0, 14, "--scrub-every=") == 0) {
+            scrubEvery = atoi(arg.c_str() + 14);
+        }
+        else if (arg.compare(0, 14, "--stripe-unit=") == 0) {
+            options.stripeUnit = atoi(arg.c_str() + 14) * 1024;
+        }
+        else {
+            cerr << "!!! Unknown option '" << arg << "' !!!\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((int)options.stripePaths.size() > StripeSet::MAX_STRIPES) {
+        cerr << "!!! At most " << StripeSet::MAX_STRIPES << " stripe files !!!\n";
+        return 1;
+    }
+    for (int i = 0; i < (int)options.stripePaths.size(); i++) {
+        if ((int)options.stripePaths[i].size() >= StripeSet::MAX_PATH_LENGTH - 4) {
+            cerr << "!!! Stripe file name too long: " << options.stripePaths[i] << " !!!\n";
+            return 1;
+        }
+    }
+    if (options.stripeUnit <= 0 || options.stripeUnit % BlockCache::BLOCK_SIZE != 0) {
+        cerr << "!!! Stripe unit must be a multiple of 4KB !!!\n";
+        return 1;
+    }
+
+    if (options.readOnly && (options.sharedAccess || (!command.empty() && command[0] == "format"))) {
+        cerr << "!!! --read-only can't be used with --shared or format !!!\n";
+        return 1;
+    }
+
+    if (!connectTo.empty()) {
+        if (command.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runClient(connectTo, command);
+    }
+    string socketPath = command.size() == 2 ? command[1] : DEFAULT_SOCKET;
+
+    if (shards > 0) {
+        if (!command.empty() && command[0] == "serve") {
+            ShardedFileSystem fs(diskName, shards, options);
+            return runServer(fs, socketPath, serverLoops, scrubEvery, scrubRate);
+        }
+        if (command.empty()) {
+            ShardedFileSystem fs(diskName, shards, options);
+            runMenu(fs);
+            return 0;
+        }
+        if (command[0] == "list" && command.size() == 1) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return listVolume(fs, listOffset, listLimit, output);
+        }
+        if (command[0] == "stats" && command.size() == 1) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return showVolumeStats(fs, output);
+        }
+        if (command[0] == "cat" && command.size() == 2) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return catFile(fs, command[1]);
+        }
+        if (command[0] == "add" && command.size() >= 2) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return addFiles(fs, vector<string>(command.begin() + 1, command.end()), ttlSeconds);
+        }
+        if (command[0] == "export" && command.size() == 2) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return exportVolume(fs, command[1]);
+        }
+        if (command[0] == "import" && command.size() == 2) {
+            vector<ArchivedFile> files;
+            if (!loadArchive(command[1], files)) {
+                return 1;
+            }
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return importVolume(fs, files);
+        }
+        if (command[0] == "search" && command.size() == 2) {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return searchFiles(fs, command[1]);
+        }
+        if (command[0] == "scrub" && command.size() == 1) {
+            if (!imagesExist(diskName, shards)) {
+                return 1;
+            }
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return scrubVolume(fs, scrubRate);
+        }
+        if (command[0] == "stat" || command[0] == "setattr" || command[0] == "rmattr") {
+            options.quiet = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            return runAttributeCommand(fs, command, output);
+        }
+        if (command[0] == "quota" || command[0] == "quotas") {
+            cerr << "!!! Quotas are kept per volume, they don't work with --shards !!!\n";
+            return 1;
+        }
+        if (command[0] == "format") {
+            options.format = true;
+            ShardedFileSystem fs(diskName, shards, options);
+            cout << ">>> Formatted " << shards << " volumes " << diskName << ".0-" << (shards - 1) << " <<<\n";
+            return 0;
+        }
+    }
+
+    if (command.empty()) {
+        FileSystem fs(diskName, options);
+        runMenu(fs);
+        return 0;
+    }
+
+    if (command[0] == "bench-cache") {
+        runCacheBenchmark();
+        return 0;
+    }
+    if (command[0] == "bench-alloc") {
+        runAllocBenchmark();
+        return 0;
+    }
+    if (command[0] == "bench-async") {
+        runAsyncBenchmark();
+        return 0;
+    }
+    if (command[0] == "selftest") {
+        return runSelfTest();
+    }
+    if (command[0] == "format") {
+        options.format = true;
+        FileSystem fs(diskName, options);
+        cout << ">>> Formatted " << diskName << " with the "
+            << (options.allocPolicy == ALLOC_BUDDY ? "buddy" : "slab") << " allocator <<<\n";
+        return 0;
+    }
+    if (command[0] == "list" && command.size() == 1) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return listVolume(fs, listOffset, listLimit, output);
+    }
+    if (command[0] == "stats" && command.size() == 1) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return showVolumeStats(fs, output);
+    }
+    if (command[0] == "cat" && command.size() == 2) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return catFile(fs, command[1]);
+    }
+    if (command[0] == "add" && command.size() >= 2) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return addFiles(fs, vector<string>(command.begin() + 1, command.end()), ttlSeconds);
+    }
+    if (command[0] == "export" && command.size() == 2) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return exportVolume(fs, command[1]);
+    }
+    if (command[0] == "import" && command.size() == 2) {
+        vector<ArchivedFile> files;
+        if (!loadArchive(command[1], files)) {
+            return 1;
+        }
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return importVolume(fs, files);
+    }
+    if (command[0] == "search" && command.size() == 2) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return searchFiles(fs, command[1]);
+    }
+    if (command[0] == "scrub" && command.size() == 1) {
+        if (!imagesExist(diskName, 0)) {
+            return 1;
+        }
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return scrubVolume(fs, scrubRate);
+    }
+    if (command[0] == "stat" || command[0] == "setattr" || command[0] == "rmattr") {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        return runAttributeCommand(fs, command, output);
+    }
+    if (command[0] == "quota" && command.size() == 4) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        if (!fs.setQuota(command[1], atoi(command[2].c_str()), atoll(command[3].c_str()) * 1024 * 1024)) {
+            cerr << "!!! ERROR: Can't set a quota on '" << command[1] << "' !!!\n";
+            return 1;
+        }
+        cout << ">>> Quota for '" << command[1] << "' saved <<<\n";
+        return 0;
+    }
+    if (command[0] == "quotas" && command.size() == 1) {
+        options.quiet = true;
+        FileSystem fs(diskName, options);
+        printNamespaces(fs.namespaceUsage());
+        return 0;
+    }
+    if (command[0] == "serve" && command.size() <= 2) {
+        // The server saves once per batch of requests, not after each one,
+        // and lets local clients read straight out of its memory
+        options.deferSaves = true;
+#ifdef __linux__
+        options.shareName = "/simplefs." + to_string(getpid());
+#endif
+        FileSystem fs(diskName, options);
+        return runServer(fs, socketPath, serverLoops, scrubEvery, scrubRate);
+    }
+
+    cerr << "!!! Unknown command '" << command[0] << "' !!!\n";
+    printUsage(argv[0]);
+    return 1;
 }